@@ -0,0 +1,398 @@
+/**
+ * Chunked encrypted archive (version 2) that can be read at random
+ *
+ * Version 1 archive (<IV>:<Base-64 of Encrypted Zip File>) has to be decoded and
+ * decrypted as a whole before anything in it can be read. Version 2 stores raw
+ * cipher (no Base-64) of the zip in independently encrypted chunks, each with
+ * its own IV, so that only the chunks being read are decrypted:
+ *
+ *     magic (8 bytes), index IV (16 bytes), index cipher size (4 bytes),
+ *     index cipher, chunk ciphers...
+ *
+ * Index before encryption (numbers in little-endian):
+ *     zip size (8 bytes), chunk size (4 bytes), chunk count (8 bytes) and for
+ *     each chunk: offset of cipher in file (8 bytes), cipher size (4 bytes), IV (16 bytes)
+ *
+ * Every chunk holds chunk size bytes of zip except the last one
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+#include "external/mine.h"
+#include "arena.h"
+#include "metrics.h"
+
+/**
+ * First bytes of version 2 archive
+ */
+static const char kArchiveMagic[8] = { 'S', 'P', 'V', 'A', 'R', 'C', '0', '2' };
+
+/**
+ * AES block size, i.e, size of IVs
+ */
+static const std::size_t kArchiveBlockSize = 16;
+
+/**
+ * Default number of zip bytes in each chunk
+ */
+static const std::uint32_t kDefaultArchiveChunkSize = 1024 * 1024;
+
+/**
+ * Number of decrypted chunks kept by the reader, libzip reads the
+ * same chunk many times in small reads
+ */
+static const std::size_t kCachedArchiveChunks = 16;
+
+/**
+ * Returns true if file is a version 2 archive
+ */
+inline bool isChunkedArchive(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char magic[sizeof(kArchiveMagic)];
+    return ifs.read(magic, sizeof(magic)) && std::memcmp(magic, kArchiveMagic, sizeof(magic)) == 0;
+}
+
+namespace archive {
+
+inline void appendLE(std::string* contents, std::uint64_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i)
+    {
+        contents->push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+inline std::uint64_t readLE(const char* data, std::size_t bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = bytes; i > 0; --i)
+    {
+        value = (value << 8) | static_cast<unsigned char>(data[i - 1]);
+    }
+    return value;
+}
+
+/**
+ * Encrypts len bytes with fresh IV, appends the IV to ivs and returns the cipher
+ */
+inline std::string encrypt(mine::AES* aesManager, const mine::AES::Key& key, const char* data, std::size_t len, std::string* ivs)
+{
+    const mine::ByteArray iv = mine::MineCommon::generateRandomBytes(kArchiveBlockSize);
+    std::string cipher(mine::AES::cipherSize(len), '\0');
+    aesManager->encryptInto(reinterpret_cast<const mine::byte*>(data), len, reinterpret_cast<mine::byte*>(&cipher[0]), &key, iv);
+    ivs->append(iv.begin(), iv.end());
+    return cipher;
+}
+
+/**
+ * Decrypts cipher in to plain (of capacity bytes), of which exactly len bytes are plain
+ * and the rest (up to cipher size) are left over. The length is known so padding is never
+ * guessed from the plain bytes (a full chunk is not padded and may end in anything)
+ */
+inline void decrypt(const mine::AES::Key& key, const std::string& cipher, const char* iv, std::size_t len, char* plain, std::size_t capacity)
+{
+    if (cipher.size() % kArchiveBlockSize != 0 || cipher.size() < len || cipher.size() > capacity)
+    {
+        throw std::runtime_error("Invalid archive chunk");
+    }
+    if (!cipher.empty())
+    {
+        mine::AES aesManager;
+        aesManager.decryptRawInto(reinterpret_cast<const mine::byte*>(cipher.data()), cipher.size(), reinterpret_cast<mine::byte*>(plain),
+                                  &key, mine::ByteArray(iv, iv + kArchiveBlockSize));
+    }
+}
+
+/**
+ * Decrypts cipher and returns exactly len bytes of plain, for the index only (see ChunkedArchive
+ * for the chunks, whose plain is kept in secure arena)
+ */
+inline std::string decrypt(const mine::AES::Key& key, const std::string& cipher, const char* iv, std::size_t len)
+{
+    std::string plain(cipher.size(), '\0');
+    decrypt(key, cipher, iv, len, &plain[0], plain.size());
+    plain.resize(len);
+    return plain;
+}
+
+} // namespace archive
+
+/**
+ * Writes zip as version 2 archive encrypted with key (Base-16)
+ */
+inline void packChunkedArchive(std::istream& zip, std::ostream& output, const std::string& key, std::uint32_t chunkSize = kDefaultArchiveChunkSize)
+{
+    if (chunkSize == 0 || chunkSize % kArchiveBlockSize != 0)
+    {
+        throw std::invalid_argument("Chunk size must be a multiple of AES block size");
+    }
+    mine::AES aesManager;
+    const mine::AES::Key aesKey = mine::Base16::fromString(key);
+    
+    // offsets of chunks in the index depend on the index size, i.e, on the chunk count,
+    // so all chunks are encrypted (and held in memory) before anything is written
+    std::vector<std::string> ciphers;
+    std::string ivs;
+    std::uint64_t zipSize = 0;
+    SecureArena arena; // chunk of zip is wiped once packed
+    char* plain = arena.allocate(chunkSize);
+    while (zip.read(plain, chunkSize) || zip.gcount() > 0)
+    {
+        const std::size_t len = static_cast<std::size_t>(zip.gcount());
+        ciphers.push_back(archive::encrypt(&aesManager, aesKey, plain, len, &ivs));
+        zipSize += len;
+    }
+    
+    const std::size_t entrySize = 8 + 4 + kArchiveBlockSize;
+    const std::size_t indexSize = 8 + 4 + 8 + ciphers.size() * entrySize;
+    std::uint64_t offset = sizeof(kArchiveMagic) + kArchiveBlockSize + 4 + mine::AES::cipherSize(indexSize);
+    std::string index;
+    archive::appendLE(&index, zipSize, 8);
+    archive::appendLE(&index, chunkSize, 4);
+    archive::appendLE(&index, ciphers.size(), 8);
+    for (std::size_t i = 0; i < ciphers.size(); ++i)
+    {
+        archive::appendLE(&index, offset, 8);
+        archive::appendLE(&index, ciphers[i].size(), 4);
+        index.append(ivs, i * kArchiveBlockSize, kArchiveBlockSize);
+        offset += ciphers[i].size();
+    }
+    
+    std::string indexIV;
+    const std::string indexCipher = archive::encrypt(&aesManager, aesKey, index.data(), index.size(), &indexIV);
+    std::string header(kArchiveMagic, sizeof(kArchiveMagic));
+    header.append(indexIV);
+    archive::appendLE(&header, indexCipher.size(), 4);
+    output.write(header.data(), header.size());
+    output.write(indexCipher.data(), indexCipher.size());
+    for (const std::string& cipher : ciphers)
+    {
+        output.write(cipher.data(), cipher.size());
+    }
+    if (!output.flush())
+    {
+        throw std::runtime_error("Unable to write archive");
+    }
+}
+
+/**
+ * Reads zip out of version 2 archive, decrypting only the chunks that are read.
+ * Decrypted chunks are kept in secure arena, in buffers that are wiped and reused
+ * once chunks are evicted. read() is safe to call from any thread
+ */
+struct ChunkedArchive
+{
+    /**
+     * Opens archive and decrypts its index, throws if it is not a version 2
+     * archive or cannot be decrypted with key (Base-16)
+     * \param lockMemory Lock decrypted chunks in memory, see SecureArena
+     */
+    ChunkedArchive(const std::string& filename, const std::string& key_, bool lockMemory = false)
+        : file(filename, std::ios::binary), key(mine::Base16::fromString(key_)), arena(lockMemory)
+    {
+        char header[sizeof(kArchiveMagic) + kArchiveBlockSize + 4];
+        if (!file.read(header, sizeof(header)) || std::memcmp(header, kArchiveMagic, sizeof(kArchiveMagic)) != 0)
+        {
+            throw std::runtime_error("Invalid archive [" + filename + "]");
+        }
+        const char* indexIV = header + sizeof(kArchiveMagic);
+        std::string indexCipher(archive::readLE(indexIV + kArchiveBlockSize, 4), '\0');
+        if (!file.read(&indexCipher[0], indexCipher.size()) || indexCipher.size() < kArchiveBlockSize * 2)
+        {
+            throw std::runtime_error("Truncated archive [" + filename + "]");
+        }
+        
+        // index length is only known after the first block, which holds the chunk count
+        const std::string start = archive::decrypt(key, indexCipher.substr(0, kArchiveBlockSize * 2), indexIV, 20);
+        zipSize = archive::readLE(start.data(), 8);
+        chunkSize = static_cast<std::uint32_t>(archive::readLE(start.data() + 8, 4));
+        const std::uint64_t count = archive::readLE(start.data() + 12, 8);
+        const std::size_t entrySize = 8 + 4 + kArchiveBlockSize;
+        if (chunkSize == 0
+            || count != (zipSize + chunkSize - 1) / chunkSize
+            || count > (indexCipher.size() - 20) / entrySize)
+        {
+            throw std::runtime_error("Unable to decrypt archive [" + filename + "], wrong key?");
+        }
+        const std::string index = archive::decrypt(key, indexCipher, indexIV, 20 + count * entrySize);
+        chunks.resize(count);
+        for (std::uint64_t i = 0; i < count; ++i)
+        {
+            const char* entry = index.data() + 20 + i * entrySize;
+            chunks[i].offset = archive::readLE(entry, 8);
+            chunks[i].cipherSize = static_cast<std::uint32_t>(archive::readLE(entry + 8, 4));
+            chunks[i].iv.assign(entry + 12, kArchiveBlockSize);
+        }
+    }
+    
+    /**
+     * Size of the zip
+     */
+    inline std::uint64_t size() const
+    {
+        return zipSize;
+    }
+    
+    /**
+     * Number of chunks decrypted so far
+     */
+    inline std::size_t decryptedChunks() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return decryptions;
+    }
+    
+    /**
+     * Reads len bytes of zip at offset, returns false if they are out of range
+     * or the archive cannot be read
+     */
+    bool read(std::uint64_t offset, void* data, std::uint64_t len)
+    {
+        if (offset > zipSize || len > zipSize - offset)
+        {
+            return false;
+        }
+        char* output = static_cast<char*>(data);
+        try
+        {
+            while (len > 0)
+            {
+                const std::size_t index = static_cast<std::size_t>(offset / chunkSize);
+                const std::size_t position = static_cast<std::size_t>(offset % chunkSize);
+                const std::shared_ptr<const Plain> chunk = load(index);
+                const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(len, chunk->size - position));
+                std::memcpy(output, chunk->data + position, count);
+                output += count;
+                offset += count;
+                len -= count;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Chunk
+    {
+        std::uint64_t offset;
+        std::uint32_t cipherSize;
+        std::string iv;
+    };
+    
+    /**
+     * Decrypted chunk in buffer of arena, given back to free buffers once released
+     */
+    struct Plain
+    {
+        char* data;
+        std::size_t size;
+    };
+    
+    /**
+     * Returns decrypted chunk, only reading the file is serialized, chunks are
+     * decrypted by the calling threads
+     */
+    std::shared_ptr<const Plain> load(std::size_t index)
+    {
+        std::string cipher;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = cache.begin(); it != cache.end(); ++it)
+            {
+                if (it->first == index)
+                {
+                    cache.splice(cache.begin(), cache, it);
+                    return it->second;
+                }
+            }
+            const Chunk& chunk = chunks.at(index);
+            MetricsTimer timer("file read", chunk.cipherSize);
+            cipher.resize(chunk.cipherSize);
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(chunk.offset));
+            if (!file.read(&cipher[0], cipher.size()))
+            {
+                throw std::runtime_error("Truncated archive");
+            }
+        }
+        
+        const std::uint64_t start = static_cast<std::uint64_t>(index) * chunkSize;
+        const std::size_t len = static_cast<std::size_t>(std::min<std::uint64_t>(chunkSize, zipSize - start));
+        std::shared_ptr<const Plain> plain(new Plain{ takeBuffer(), len }, [this](const Plain* released) {
+            giveBuffer(released->data);
+            delete released;
+        });
+        archive::decrypt(key, cipher, chunks[index].iv.data(), len, plain->data, chunkSize);
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        ++decryptions;
+        cache.emplace_front(index, plain);
+        if (cache.size() > kCachedArchiveChunks)
+        {
+            cache.pop_back();
+        }
+        return plain;
+    }
+    
+    /**
+     * Returns free buffer of chunk size, there are never more buffers than cached
+     * chunks and chunks being read
+     */
+    char* takeBuffer()
+    {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        if (buffers.empty())
+        {
+            return arena.allocate(chunkSize);
+        }
+        char* buffer = buffers.back();
+        buffers.pop_back();
+        return buffer;
+    }
+    
+    void giveBuffer(char* buffer)
+    {
+        SecureArena::wipe(buffer, chunkSize);
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffers.push_back(buffer);
+    }
+    
+    std::ifstream file;
+    mine::AES::Key key;
+    std::uint64_t zipSize = 0;
+    std::uint32_t chunkSize = 0;
+    std::vector<Chunk> chunks;
+    
+    /**
+     * Buffers are declared before cache so that cached chunks are given back first
+     */
+    SecureArena arena;
+    std::vector<char*> buffers;
+    std::mutex buffersMutex;
+    std::list<std::pair<std::size_t, std::shared_ptr<const Plain>>> cache;
+    std::size_t decryptions = 0;
+    mutable std::mutex mutex;
+};
+
+#endif // ARCHIVE_H
@@ -0,0 +1,194 @@
+/**
+ * Secure arena for plaintext (decrypted zip and photos read from it)
+ *
+ * Buffers are handed out from large slabs mapped up front instead of allocating
+ * each one separately. Slabs are optionally locked in memory (mlock) so that
+ * plaintext is never swapped to disk, are left out of core dumps and are wiped
+ * and released all together when arena is destroyed. Buffers are never freed
+ * one by one, share arena (e.g, with aliasing shared_ptr) to keep them alive
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <mutex>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Size of first slab of secure arena, each next one is twice as big up to maximum size.
+ * Requests larger than quarter of maximum size get slab of their own
+ */
+static const std::size_t kSecureArenaFirstSlabSize = 1024 * 1024;
+static const std::size_t kSecureArenaSlabSize = 64 * 1024 * 1024;
+
+/**
+ * Alignment of buffers handed out by secure arena
+ */
+static const std::size_t kSecureArenaAlignment = 16;
+
+struct SecureArena
+{
+    /**
+     * \param lock_ Lock slabs in memory, slabs that can not be locked (e.g, over RLIMIT_MEMLOCK)
+     *              are still used, see isLocked()
+     */
+    explicit SecureArena(bool lock_ = false)
+        : lock(lock_), pageSize(static_cast<std::size_t>(sysconf(_SC_PAGESIZE)))
+    {
+    }
+    
+    SecureArena(const SecureArena&) = delete;
+    SecureArena& operator=(const SecureArena&) = delete;
+    
+    ~SecureArena()
+    {
+        for (Slab& slab : slabs)
+        {
+            wipe(slab.data, slab.used);
+            if (slab.locked)
+            {
+                munlock(slab.data, slab.size);
+            }
+            munmap(slab.data, slab.size);
+        }
+    }
+    
+    /**
+     * Zeroes size bytes of data, e.g, buffer that is about to be reused
+     */
+    static void wipe(void* data, std::size_t size)
+    {
+        // memset through volatile pointer so that wiping is not optimized away
+        static void* (* const volatile zero)(void*, int, std::size_t) = std::memset;
+        zero(data, 0, size);
+    }
+    
+    /**
+     * Makes sure next size bytes are handed out from single slab, without mapping more slabs
+     * while they are being allocated (e.g, total size of entries about to be read)
+     */
+    void reserve(std::size_t size)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (slabs.empty() || slabs[current].size - slabs[current].used < size)
+        {
+            addSlab(std::max(size, nextSlabSize()));
+            current = slabs.size() - 1;
+        }
+    }
+    
+    /**
+     * Returns buffer of size bytes (at least one), called from any thread. Throws std::bad_alloc
+     * if it can not be mapped
+     */
+    char* allocate(std::size_t size)
+    {
+        size = (std::max<std::size_t>(size, 1) + kSecureArenaAlignment - 1) / kSecureArenaAlignment * kSecureArenaAlignment;
+        std::lock_guard<std::mutex> guard(mutex);
+        bytesAllocated += size;
+        if (slabs.empty() || slabs[current].size - slabs[current].used < size)
+        {
+            if (size > kSecureArenaSlabSize / 4)
+            {
+                // own slab, current one is kept for smaller requests
+                Slab& slab = addSlab(size);
+                slab.used = size;
+                return slab.data;
+            }
+            addSlab(std::max(size, nextSlabSize()));
+            current = slabs.size() - 1;
+        }
+        Slab& slab = slabs[current];
+        char* buffer = slab.data + slab.used;
+        slab.used += size;
+        return buffer;
+    }
+    
+    /**
+     * Number of bytes handed out and mapped
+     */
+    std::size_t allocated()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return bytesAllocated;
+    }
+    
+    std::size_t mapped()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::size_t total = 0;
+        for (const Slab& slab : slabs)
+        {
+            total += slab.size;
+        }
+        return total;
+    }
+    
+    /**
+     * True if locking was requested and every slab is locked in memory
+     */
+    bool isLocked()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return lock && std::all_of(slabs.begin(), slabs.end(), [](const Slab& slab) { return slab.locked; });
+    }
+
+private:
+    struct Slab
+    {
+        char* data;
+        std::size_t size;
+        std::size_t used;
+        bool locked;
+    };
+    
+    /**
+     * Size of next slab for small requests, mutex must be held
+     */
+    std::size_t nextSlabSize() const
+    {
+        return slabs.empty() ? kSecureArenaFirstSlabSize : std::min(slabs[current].size * 2, kSecureArenaSlabSize);
+    }
+    
+    /**
+     * Maps new slab of at least size bytes, mutex must be held
+     */
+    Slab& addSlab(std::size_t size)
+    {
+        size = (size + pageSize - 1) / pageSize * pageSize;
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_DONTDUMP
+        madvise(data, size, MADV_DONTDUMP);
+#endif
+        const bool locked = lock && mlock(data, size) == 0;
+        slabs.push_back({ static_cast<char*>(data), size, 0, locked });
+        return slabs.back();
+    }
+    
+    bool lock;
+    std::size_t pageSize;
+    std::vector<Slab> slabs;
+    
+    /**
+     * Slab that small buffers are handed out from
+     */
+    std::size_t current = 0;
+    std::size_t bytesAllocated = 0;
+    std::mutex mutex;
+};
+
+#endif // ARENA_H
@@ -0,0 +1,383 @@
+/**
+ * Headless benchmarks for secure photo viewer, these do not need a display
+ *
+ *    make bench [BENCH_ARGS="--photos=<N> --width=<N> --height=<N>"]
+ *
+ * Options:
+ *      --photos=<N>: Number of synthetic photos (default: 40)
+ *      --width=<N>, --height=<N>: Size of synthetic photos in pixels (default: 1920x1280)
+ *
+ * Results are printed one per line as <benchmark> <key>=<value>... so that they can
+ * be compared between runs. SPV_METRICS=<file> also writes phase metrics (see metrics.h)
+ *
+ * Benchmarks:
+ *      - navigation: Flips through synthetic photos forward and back the way viewer
+ *                    does. Fails if a single navigation decodes more than one photo
+ *      - decode: Decodes large camera sized JPEG at full size, to fit the screen
+ *                and as thumbnail
+ *      - pipeline: Packs synthetic photos in to encrypted archive (<IV>:<B64>) and times
+ *                  each step of opening it: Base-64 decoding, AES decryption, unpack()
+ *                  (both together, from file), listing and reading entries and decoding
+ *                  photos to fit the screen. Reports MB/s of each step
+ *      - rss: Peak resident set size of the whole run
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <filesystem>
+
+#include <sys/resource.h>
+
+#include <SFML/Graphics.hpp>
+
+#include "external/mine.h"
+#include "external/libzippp.h"
+#include "gallery.h"
+#include "unpack.h"
+#include "metrics.h"
+
+/**
+ * Number of synthetic photos
+ */
+static const std::size_t kPhotoCount = 40;
+
+/**
+ * Size of synthetic photos in pixels
+ */
+static const unsigned kPhotoWidth = 1920;
+static const unsigned kPhotoHeight = 1280;
+
+/**
+ * Size of camera sized photo and screen for decode benchmark
+ */
+static const unsigned kLargePhotoWidth = 6000;
+static const unsigned kLargePhotoHeight = 4000;
+static const unsigned kScreenWidth = 1920;
+static const unsigned kScreenHeight = 1080;
+
+/**
+ * Key (AES-256) of synthetic archive
+ */
+static const std::string kArchiveKey = "163E6AC9AAC3AE7F0B0A6F2E1E58D3E9CF5B1D02A67E4C8840B1E9E6D7A3F215";
+
+/**
+ * Creates JPEG photos of noise so that they do not compress to nothing
+ */
+std::vector<Item> createPhotos(std::size_t count, unsigned width, unsigned height)
+{
+    std::vector<Item> items;
+    items.reserve(count);
+    std::mt19937 rng(count);
+    std::vector<sf::Uint8> pixels(static_cast<std::size_t>(width) * height * 4);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        for (std::size_t p = 0; p < pixels.size(); p += 4)
+        {
+            const std::uint32_t r = rng();
+            pixels[p] = static_cast<sf::Uint8>(r);
+            pixels[p + 1] = static_cast<sf::Uint8>(r >> 8);
+            pixels[p + 2] = static_cast<sf::Uint8>(r >> 16);
+            pixels[p + 3] = 255;
+        }
+        sf::Image image;
+        image.create(width, height, pixels.data());
+        std::vector<sf::Uint8> encoded;
+        if (!image.saveToMemory(encoded, "jpg"))
+        {
+            throw "Unable to encode synthetic photo";
+        }
+        std::shared_ptr<char[]> data(new char[encoded.size()]);
+        std::memcpy(data.get(), encoded.data(), encoded.size());
+        items.emplace_back(std::move(data), encoded.size(), "photo-" + std::to_string(i) + ".jpg");
+    }
+    return items;
+}
+
+/**
+ * Navigates forward through all the photos and back again. Returns false
+ * if any navigation decoded more than one photo (prefetch disabled) or if
+ * photos were decoded more than once overall (prefetch enabled)
+ */
+bool benchNavigation(const std::vector<Item>& items, std::size_t prefetch)
+{
+    ImageCache cache;
+    Prefetcher prefetcher;
+    prefetcher.count = prefetch;
+    if (prefetch > 0)
+    {
+        prefetcher.start(&items, &cache, kPrefetchThreads);
+    }
+    
+    std::size_t navigations = 0;
+    std::size_t maxDecodes = 0;
+    const auto started = std::chrono::steady_clock::now();
+    for (int direction : { 1, -1 })
+    {
+        for (std::size_t i = 0; i < items.size(); ++i)
+        {
+            const std::size_t index = direction > 0 ? i : items.size() - 1 - i;
+            const std::size_t before = cache.decodes();
+            cache.get(index, items.at(index));
+            prefetcher.schedule(index, direction);
+            maxDecodes = std::max(maxDecodes, cache.decodes() - before);
+            ++navigations;
+        }
+    }
+    prefetcher.stop();
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    
+    const std::size_t decodes = cache.decodes();
+    std::cout << "navigation prefetch=" << prefetch
+              << " navigations=" << navigations
+              << " decodes=" << decodes
+              << " decodes_per_navigation=" << (static_cast<double>(decodes) / navigations)
+              << " max_decodes_per_navigation=" << maxDecodes
+              << " ms_per_navigation=" << (elapsed / navigations) << std::endl;
+    cache.report(std::cout);
+    
+    if (prefetch == 0)
+    {
+        return maxDecodes <= 1;
+    }
+    // everything fits in the cache so each photo is decoded only once
+    return decodes <= items.size();
+}
+
+/**
+ * Times decoding of single large photo at full size, screen size and thumbnail size
+ */
+void benchDecode()
+{
+    const unsigned width = kLargePhotoWidth;
+    const unsigned height = kLargePhotoHeight;
+    std::vector<sf::Uint8> pixels(static_cast<std::size_t>(width) * height * 4);
+    for (unsigned y = 0; y < height; ++y)
+    {
+        for (unsigned x = 0; x < width; ++x)
+        {
+            sf::Uint8* pixel = &pixels[(static_cast<std::size_t>(y) * width + x) * 4];
+            pixel[0] = static_cast<sf::Uint8>(x * 255 / width);
+            pixel[1] = static_cast<sf::Uint8>(y * 255 / height);
+            pixel[2] = static_cast<sf::Uint8>(x ^ y);
+            pixel[3] = 255;
+        }
+    }
+    sf::Image image;
+    image.create(width, height, pixels.data());
+    std::vector<sf::Uint8> encoded;
+    if (!image.saveToMemory(encoded, "jpg"))
+    {
+        throw "Unable to encode synthetic photo";
+    }
+    std::shared_ptr<char[]> data(new char[encoded.size()]);
+    std::memcpy(data.get(), encoded.data(), encoded.size());
+    const Item item(std::move(data), encoded.size(), "large.jpg");
+    
+    const auto time = [&](const sf::Vector2u& maxSize) {
+        const auto started = std::chrono::steady_clock::now();
+        item.decode(maxSize);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    };
+    std::cout << "decode size=" << width << "x" << height
+              << " full_ms=" << time(sf::Vector2u())
+              << " screen_ms=" << time(sf::Vector2u(kScreenWidth, kScreenHeight))
+              << " thumbnail_ms=" << time(sf::Vector2u(kThumbnailSize, kThumbnailSize)) << std::endl;
+}
+
+/**
+ * Prints throughput of single pipeline step
+ */
+void reportStep(const std::string& step, std::uint64_t bytes, std::chrono::steady_clock::time_point started)
+{
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "pipeline step=" << step
+              << " bytes=" << bytes
+              << " ms=" << elapsed
+              << " mb_per_s=" << (elapsed > 0 ? bytes / (elapsed / 1000) / 1024 / 1024 : 0) << std::endl;
+}
+
+/**
+ * Packs photos in to encrypted archive and times each step of reading it back
+ */
+void benchPipeline(const std::vector<Item>& photos)
+{
+    const std::filesystem::path directory = std::filesystem::temp_directory_path();
+    const std::string zipFilename = (directory / "secure-photo-bench.zip").string();
+    const std::string archiveFilename = (directory / "secure-photo-bench.archive").string();
+    
+    std::uint64_t photoBytes = 0;
+    {
+        libzippp::ZipArchive zf(zipFilename);
+        if (!zf.open(libzippp::ZipArchive::NEW))
+        {
+            throw "Unable to create synthetic zip";
+        }
+        for (const Item& photo : photos)
+        {
+            zf.addData(photo.name, photo.data.get(), photo.size);
+            photoBytes += photo.size;
+        }
+        zf.close();
+    }
+    std::ifstream zipStream(zipFilename, std::ios::binary);
+    const std::string zip((std::istreambuf_iterator<char>(zipStream)), std::istreambuf_iterator<char>());
+    zipStream.close();
+    std::filesystem::remove(zipFilename);
+    
+    mine::AES aesManager;
+    aesManager.setKey(kArchiveKey);
+    aesManager.setThreadCount(0); // all hardware threads, same as viewer
+    std::string iv;
+    const std::string payload = aesManager.encr(zip, iv, mine::MineCommon::Encoding::Raw, mine::MineCommon::Encoding::Base64);
+    {
+        std::ofstream ofs(archiveFilename, std::ios::binary | std::ios::trunc);
+        ofs << iv << ":" << payload;
+    }
+    std::cout << "pipeline photos=" << photos.size()
+              << " photo_bytes=" << photoBytes
+              << " zip_bytes=" << zip.size()
+              << " archive_bytes=" << (iv.size() + 1 + payload.size()) << std::endl;
+    
+    auto started = std::chrono::steady_clock::now();
+    std::vector<mine::byte> cipher(mine::Base64::maxDecodedLength(payload.size()));
+    cipher.resize(mine::Base64::decode(payload.data(), payload.size(), cipher.data()));
+    reportStep("base64_decode", payload.size(), started);
+    
+    started = std::chrono::steady_clock::now();
+    const mine::AES::Key key = mine::Base16::fromString(kArchiveKey);
+    std::vector<mine::byte> plain(cipher.size());
+    plain.resize(aesManager.decryptInto(cipher.data(), cipher.size(), plain.data(), &key, mine::Base16::fromString(iv)));
+    reportStep("aes_decrypt", cipher.size(), started);
+    cipher = std::vector<mine::byte>();
+    if (plain.size() != zip.size() || std::memcmp(plain.data(), zip.data(), zip.size()) != 0)
+    {
+        throw "Decrypted archive does not match the original";
+    }
+    plain = std::vector<mine::byte>();
+    
+    started = std::chrono::steady_clock::now();
+    const auto buffer = std::make_shared<SecureArena>();
+    std::size_t unpackedSize = 0;
+    const char* unpacked = unpack(archiveFilename, kArchiveKey, buffer.get(), &unpackedSize);
+    reportStep("unpack", iv.size() + 1 + payload.size(), started);
+    std::filesystem::remove(archiveFilename);
+    if (unpackedSize != zip.size() || std::memcmp(unpacked, zip.data(), zip.size()) != 0)
+    {
+        throw "Unpacked archive does not match the original";
+    }
+    
+    started = std::chrono::steady_clock::now();
+    std::vector<Item> items;
+    {
+        libzippp::ZipArchive zf(unpacked, unpackedSize);
+        if (!zf.open(libzippp::ZipArchive::READ_ONLY))
+        {
+            throw "Unable to open unpacked archive";
+        }
+        const std::vector<libzippp::ZipEntry> entries = listImages(zf);
+        items.reserve(entries.size());
+        readItems(zf, entries, std::make_shared<SecureArena>(), buffer, &items);
+        zf.close();
+    }
+    reportStep("create_list", unpackedSize, started);
+    if (items.size() != photos.size())
+    {
+        throw "Unable to read all the photos from unpacked archive";
+    }
+    
+    started = std::chrono::steady_clock::now();
+    for (const Item& item : items)
+    {
+        item.decode(sf::Vector2u(kScreenWidth, kScreenHeight));
+    }
+    reportStep("decode", photoBytes, started);
+}
+
+/**
+ * Peak resident set size of the process in KB
+ */
+long peakRssKb()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return -1;
+    }
+    return usage.ru_maxrss; // KB on Linux, bytes on macOS
+}
+
+int main(int argc, const char** argv)
+{
+    try
+    {
+        std::size_t photoCount = kPhotoCount;
+        unsigned photoWidth = kPhotoWidth;
+        unsigned photoHeight = kPhotoHeight;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg.compare(0, 9, "--photos=") == 0)
+            {
+                photoCount = std::stoul(arg.substr(9));
+            }
+            else if (arg.compare(0, 8, "--width=") == 0)
+            {
+                photoWidth = static_cast<unsigned>(std::stoul(arg.substr(8)));
+            }
+            else if (arg.compare(0, 9, "--height=") == 0)
+            {
+                photoHeight = static_cast<unsigned>(std::stoul(arg.substr(9)));
+            }
+            else
+            {
+                throw std::invalid_argument("Unknown option: " + arg);
+            }
+        }
+        if (photoCount == 0 || photoWidth == 0 || photoHeight == 0)
+        {
+            throw std::invalid_argument("Number and size of photos must be positive");
+        }
+        
+        metrics().configure(nullptr, nullptr);
+        if (metrics().enabled)
+        {
+            mine::AES::setProfiler([](const char* phase, Metrics::Clock::time_point started, Metrics::Clock::time_point ended, std::size_t bytes) {
+                metrics().record(phase, started, ended, bytes);
+            });
+        }
+        
+        const std::vector<Item> items = createPhotos(photoCount, photoWidth, photoHeight);
+        bool ok = benchNavigation(items, 0);
+        ok = benchNavigation(items, kDefaultPrefetch) && ok;
+        if (!ok)
+        {
+            std::cerr << "navigation: photos decoded more than expected" << std::endl;
+            return 1;
+        }
+        benchDecode();
+        benchPipeline(items);
+        std::cout << "rss peak_kb=" << peakRssKb() << std::endl;
+        metrics().write();
+    }
+    catch (const char* e)
+    {
+        std::cerr << e << std::endl;
+        return 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,220 @@
+/**
+ * Background export of photos from secure archive, so that writing big files
+ * (or whole archive) never blocks the viewer
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <iterator>
+#include <utility>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "metrics.h"
+
+/**
+ * Number of photos written at the same time
+ */
+static const std::size_t kExportThreads = 4;
+
+/**
+ * Parses selection of photos (one-based, inclusive) e.g, "1-10,15" or "all"
+ * in to ranges, "all" is single range up to the largest number
+ */
+inline std::vector<std::pair<std::size_t, std::size_t>> parseSelection(const std::string& selection)
+{
+    std::vector<std::pair<std::size_t, std::size_t>> ranges;
+    if (selection.empty() || selection == "all")
+    {
+        ranges.emplace_back(1, static_cast<std::size_t>(-1));
+        return ranges;
+    }
+    const auto number = [&](const std::string& value) -> std::size_t {
+        std::size_t pos = 0;
+        unsigned long long result = 0;
+        try
+        {
+            result = std::stoull(value, &pos);
+        }
+        catch (const std::exception&)
+        {
+            pos = 0;
+        }
+        if (pos == 0 || pos != value.size() || result == 0)
+        {
+            throw std::invalid_argument("Invalid selection of photos: " + selection);
+        }
+        return static_cast<std::size_t>(result);
+    };
+    std::size_t begin = 0;
+    while (begin <= selection.size())
+    {
+        std::size_t end = selection.find(',', begin);
+        end = end == std::string::npos ? selection.size() : end;
+        const std::string part = selection.substr(begin, end - begin);
+        const std::size_t dash = part.find('-');
+        const std::size_t first = number(part.substr(0, dash));
+        const std::size_t last = dash == std::string::npos ? first : number(part.substr(dash + 1));
+        if (last < first)
+        {
+            throw std::invalid_argument("Invalid selection of photos: " + selection);
+        }
+        ranges.emplace_back(first, last);
+        begin = end + 1;
+    }
+    return ranges;
+}
+
+/**
+ * Writes photos straight from their (in-memory) data on worker threads. Each
+ * photo being exported keeps its data alive, nothing is copied
+ */
+struct ExportQueue
+{
+    struct Job
+    {
+        std::shared_ptr<const char[]> data;
+        std::size_t size;
+        std::string filename;
+    };
+    
+    std::vector<std::thread> workers;
+    
+    std::deque<Job> queue;
+    
+    /**
+     * Photos added, written and failed since queue was last idle
+     */
+    std::size_t total = 0;
+    std::size_t written = 0;
+    std::size_t failed = 0;
+    
+    bool stopping = false;
+    
+    std::mutex mutex;
+    
+    std::condition_variable queued;
+    
+    ~ExportQueue()
+    {
+        stop();
+    }
+    
+    void start(std::size_t threadCount)
+    {
+        stopping = false;
+        for (std::size_t i = 0; i < threadCount; ++i)
+        {
+            workers.emplace_back(&ExportQueue::run, this);
+        }
+    }
+    
+    /**
+     * Stops once every photo waiting is written, photos asked to be exported are never dropped
+     */
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+    }
+    
+    /**
+     * Adds photos to the end of the queue, all of them are part of the same batch
+     */
+    void add(std::vector<Job> jobs)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (total == written + failed)
+            {
+                total = written = failed = 0; // new batch
+            }
+            total += jobs.size();
+            std::move(jobs.begin(), jobs.end(), std::back_inserter(queue));
+        }
+        queued.notify_all();
+    }
+    
+    bool isBusy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total > written + failed;
+    }
+    
+    /**
+     * Progress for window title, empty when idle
+     */
+    std::string status()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (total == written + failed)
+        {
+            return "";
+        }
+        return "Exporting " + std::to_string(written + failed) + " / " + std::to_string(total);
+    }
+    
+    void run()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (queue.empty())
+                {
+                    return;
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            bool ok = false;
+            {
+                MetricsTimer timer("export write", job.size);
+                std::ofstream ofs(job.filename, std::ios::binary | std::ios::trunc);
+                ofs.write(job.data.get(), static_cast<std::streamsize>(job.size));
+                ofs.close();
+                ok = !ofs.fail();
+            }
+            job.data.reset();
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok)
+            {
+                ++written;
+            }
+            else
+            {
+                ++failed;
+                std::cerr << "Unable to save [" << job.filename << "]" << std::endl;
+            }
+            if (total == written + failed && total > 1)
+            {
+                std::cout << "Exported " << written << " / " << total << " photos" << std::endl;
+            }
+        }
+    }
+};
+
+#endif // EXPORT_H
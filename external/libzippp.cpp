@@ -34,14 +34,133 @@
 
 #include <zip.h>
 #include <errno.h>
+#include <stdio.h>
 #include <fstream>
 #include <memory>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #include "libzippp.h"
 
 using namespace libzippp;
 using namespace std;
 
+namespace {
+    //little-endian readers for the zip structures
+    libzippp_uint64 readLE(const unsigned char* data, int bytes) {
+        libzippp_uint64 value = 0;
+        for (int i=bytes-1 ; i>=0 ; --i) { value = (value << 8) | data[i]; }
+        return value;
+    }
+    
+    //true if length bytes at offset are inside a buffer of size bytes (without overflowing)
+    bool fitsIn(libzippp_uint64 offset, libzippp_uint64 length, libzippp_uint64 size) {
+        return offset<=size && length<=size-offset;
+    }
+    
+    const libzippp_uint64 ZIP_EOCD_SIGNATURE = 0x06054b50;
+    const libzippp_uint64 ZIP64_EOCD_LOCATOR_SIGNATURE = 0x07064b50;
+    const libzippp_uint64 ZIP64_EOCD_SIGNATURE = 0x06064b50;
+    const libzippp_uint64 ZIP_CENTRAL_SIGNATURE = 0x02014b50;
+    const libzippp_uint64 ZIP_LOCAL_SIGNATURE = 0x04034b50;
+    const libzippp_uint64 ZIP64_EXTRA_ID = 0x0001;
+    
+    //libzip source pulling the data from a ZipSourceReader
+    struct ReaderSource {
+        ReaderSource(const ZipSourceReader& r, libzippp_uint64 s) : reader(r), size(s), position(0) { zip_error_init(&error); }
+        ~ReaderSource(void) { zip_error_fini(&error); }
+        
+        ZipSourceReader reader;
+        libzippp_uint64 size;
+        libzippp_uint64 position;
+        zip_error_t error;
+        
+        static zip_int64_t callback(void* userdata, void* data, zip_uint64_t len, zip_source_cmd_t cmd) {
+            ReaderSource* source = static_cast<ReaderSource*>(userdata);
+            switch (cmd) {
+            case ZIP_SOURCE_OPEN:
+                source->position = 0;
+                return 0;
+            case ZIP_SOURCE_READ: {
+                libzippp_uint64 left = source->size-source->position;
+                if (len>left) { len = left; }
+                if (len>0 && !source->reader(source->position, data, len)) {
+                    zip_error_set(&source->error, ZIP_ER_READ, EIO);
+                    return -1;
+                }
+                source->position += len;
+                return len;
+            }
+            case ZIP_SOURCE_CLOSE:
+                return 0;
+            case ZIP_SOURCE_STAT: {
+                zip_stat_t* stat = static_cast<zip_stat_t*>(data);
+                zip_stat_init(stat);
+                stat->size = source->size;
+                stat->valid |= ZIP_STAT_SIZE;
+                return sizeof(zip_stat_t);
+            }
+            case ZIP_SOURCE_ERROR:
+                return zip_error_to_data(&source->error, data, len);
+            case ZIP_SOURCE_FREE:
+                delete source;
+                return 0;
+            case ZIP_SOURCE_SEEK: {
+                zip_int64_t offset = zip_source_seek_compute_offset(source->position, source->size, data, len, &source->error);
+                if (offset<0) { return -1; }
+                source->position = offset;
+                return 0;
+            }
+            case ZIP_SOURCE_TELL:
+                return source->position;
+            case ZIP_SOURCE_SUPPORTS:
+                return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT,
+                                                      ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL,
+                                                      ZIP_SOURCE_SUPPORTS, -1);
+            default:
+                zip_error_set(&source->error, ZIP_ER_OPNOTSUPP, 0);
+                return -1;
+            }
+        }
+    };
+    
+    //reads entry with the given handle in a buffer from the allocator (or new[])
+    libzippp_uint64 steadyNanoseconds(void) {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    void readEntryData(zip* handle, ZipEntryData* result, int flag, const ZipEntryAllocator& allocator) {
+        result->readStarted = steadyNanoseconds();
+        libzippp_uint64 size = result->entry.getSize();
+        char* data = allocator ? allocator(result->entry, size) : new (nothrow) char[size==0 ? 1 : size];
+        if (data==NULL) {
+            result->result = LIBZIPPP_ERROR_MEMORY_ALLOCATION;
+            return;
+        }
+        
+        struct zip_file* zipFile = zip_fopen_index(handle, result->entry.getIndex(), flag);
+        if (zipFile==NULL) {
+            result->result = LIBZIPPP_ERROR_FOPEN_FAILURE;
+        } else {
+            libzippp_int64 read = zip_fread(zipFile, data, size);
+            zip_fclose(zipFile);
+            result->result = read==static_cast<libzippp_int64>(size) ? LIBZIPPP_OK : LIBZIPPP_ERROR_FREAD_FAILURE;
+        }
+        result->readEnded = steadyNanoseconds();
+        
+        if (result->result==LIBZIPPP_OK || allocator) {
+            result->data = data;
+            result->size = size;
+        } else {
+            delete[] data;
+        }
+    }
+}
+
 string ZipEntry::getComment(void) const {
     return zipFile->getEntryComment(*this);
 }
@@ -76,7 +195,13 @@ int ZipEntry::readContent(std::ofstream& ofOutput, ZipArchive::State state, libz
    return zipFile->readEntry(*this, ofOutput, state, chunksize);
 }
 
-ZipArchive::ZipArchive(const string& zipPath, const string& password) : path(zipPath), zipHandle(NULL), mode(NOT_OPEN), password(password) {
+ZipArchive::ZipArchive(const string& zipPath, const string& password) : path(zipPath), bufferData(NULL), bufferSize(0), zipHandle(NULL), mode(NOT_OPEN), password(password), readerPool(NULL), bufferLocated(false) {
+}
+
+ZipArchive::ZipArchive(const void* data, libzippp_uint64 size, const string& password) : path(), bufferData(data), bufferSize(size), zipHandle(NULL), mode(NOT_OPEN), password(password), readerPool(NULL), bufferLocated(false) {
+}
+
+ZipArchive::ZipArchive(const ZipSourceReader& reader, libzippp_uint64 size, const string& password) : path(), bufferData(NULL), bufferSize(size), sourceReader(reader), zipHandle(NULL), mode(NOT_OPEN), password(password), readerPool(NULL), bufferLocated(false) {
 }
 
 ZipArchive::~ZipArchive(void) { 
@@ -97,7 +222,27 @@ bool ZipArchive::open(OpenMode om, bool checkConsistency) {
     }
     
     int errorFlag = 0;
-    zipHandle = zip_open(path.c_str(), zipFlag, &errorFlag);
+    if (isBuffer() || isSource()) {
+        //the buffer is not owned by the archive, hence it cannot be modified
+        if (om!=READ_ONLY) { return false; }
+        
+        zip_error_t error;
+        zip_error_init(&error);
+        zip_source_t* source = createSource(&error);
+        if (source==NULL) {
+            zip_error_fini(&error);
+            return false;
+        }
+        
+        zipHandle = zip_open_from_source(source, zipFlag, &error);
+        if (zipHandle==NULL) {
+            errorFlag = zip_error_code_zip(&error);
+            zip_source_free(source); //on success the source is owned by the zip handle
+        }
+        zip_error_fini(&error);
+    } else {
+        zipHandle = zip_open(path.c_str(), zipFlag, &errorFlag);
+    }
     
     //error during opening of the file
     if(errorFlag!=ZIP_ER_OK) {
@@ -126,7 +271,109 @@ bool ZipArchive::open(OpenMode om, bool checkConsistency) {
     return false;
 }
 
+zip_source_t* ZipArchive::createSource(zip_error_t* error) const {
+    if (isBuffer()) { return zip_source_buffer_create(bufferData, bufferSize, 0, error); }
+    
+    //each source has its own position, the reader is shared
+    ReaderSource* source = new ReaderSource(sourceReader, bufferSize);
+    zip_source_t* result = zip_source_function_create(ReaderSource::callback, source, error);
+    if (result==NULL) { delete source; }
+    return result;
+}
+
+//worker threads of readEntries, each one reads through its own handle opened once
+class ZipArchive::ReaderPool {
+public:
+    ReaderPool(const ZipArchive* archive, uint nbThreads) : job(NULL), generation(0), pending(0), stopping(false) {
+        for (uint t=0 ; t<nbThreads ; ++t) {
+            workers.push_back(thread([this, archive]() { loop(archive); }));
+        }
+    }
+    
+    ~ReaderPool(void) {
+        {
+            lock_guard<mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobQueued.notify_all();
+        for (size_t t=0 ; t<workers.size() ; ++t) { workers[t].join(); }
+    }
+    
+    inline uint size(void) const { return workers.size(); }
+    
+    //runs work on every worker (with its handle, NULL if it could not be opened) and waits for all of them
+    void run(const function<void(zip*)>& work) {
+        unique_lock<mutex> lock(jobMutex);
+        job = &work;
+        pending = workers.size();
+        ++generation;
+        jobQueued.notify_all();
+        jobDone.wait(lock, [this]() { return pending==0; });
+        job = NULL;
+    }
+    
+private:
+    vector<thread> workers;
+    mutex jobMutex;
+    condition_variable jobQueued;
+    condition_variable jobDone;
+    const function<void(zip*)>* job;
+    libzippp_uint64 generation;
+    size_t pending;
+    bool stopping;
+    
+    void loop(const ZipArchive* archive) {
+        zip* handle = archive->openHandle();
+        libzippp_uint64 done = 0;
+        unique_lock<mutex> lock(jobMutex);
+        while (true) {
+            jobQueued.wait(lock, [&]() { return stopping || generation!=done; });
+            if (stopping) { break; }
+            done = generation;
+            const function<void(zip*)>* work = job;
+            lock.unlock();
+            (*work)(handle);
+            lock.lock();
+            if (--pending==0) { jobDone.notify_all(); }
+        }
+        lock.unlock();
+        if (handle!=NULL) { zip_discard(handle); }
+    }
+};
+
+void ZipArchive::releaseReaders(void) {
+    lock_guard<mutex> lock(readerMutex);
+    delete readerPool;
+    readerPool = NULL;
+    bufferOffsets.clear();
+    bufferLocated = false;
+}
+
+zip* ZipArchive::openHandle(void) const {
+    zip* handle = NULL;
+    if (isBuffer() || isSource()) {
+        zip_error_t error;
+        zip_error_init(&error);
+        zip_source_t* source = createSource(&error);
+        if (source!=NULL) {
+            handle = zip_open_from_source(source, ZIP_RDONLY, &error);
+            if (handle==NULL) { zip_source_free(source); }
+        }
+        zip_error_fini(&error);
+    } else {
+        int errorFlag = 0;
+        handle = zip_open(path.c_str(), ZIP_RDONLY, &errorFlag);
+    }
+    
+    if (handle!=NULL && isEncrypted() && zip_set_default_password(handle, password.c_str())!=0) {
+        zip_discard(handle);
+        handle = NULL;
+    }
+    return handle;
+}
+
 int ZipArchive::close(void) {
+    releaseReaders();
     if (isOpen()) {
         int result = zip_close(zipHandle);
         zipHandle = NULL;
@@ -139,6 +386,7 @@ int ZipArchive::close(void) {
 }
 
 void ZipArchive::discard(void) {
+    releaseReaders();
     if (isOpen()) {
         zip_discard(zipHandle);
         zipHandle = NULL;
@@ -148,6 +396,7 @@ void ZipArchive::discard(void) {
 
 bool ZipArchive::unlink(void) {
     if (isOpen()) { discard(); }
+    if (isBuffer() || isSource()) { return false; } //nothing to remove from the disk
     int result = remove(path.c_str());
     return result==0;
 }
@@ -328,6 +577,145 @@ void* ZipArchive::readEntry(const ZipEntry& zipEntry, bool asText, State state,
     return NULL;
 }
 
+vector<libzippp_uint64> ZipArchive::locateBufferData(void) const {
+    vector<libzippp_uint64> offsets;
+    const unsigned char* buffer = static_cast<const unsigned char*>(bufferData);
+    if (!isBuffer() || zipHandle==NULL || bufferSize<22) { return offsets; }
+    
+    //end of central directory is at the end, followed by a comment of at most 64KB
+    libzippp_uint64 eocd = bufferSize-22;
+    libzippp_uint64 lowest = bufferSize>22+65535 ? bufferSize-22-65535 : 0;
+    while (readLE(buffer+eocd, 4)!=ZIP_EOCD_SIGNATURE) {
+        if (eocd==lowest) { return offsets; }
+        --eocd;
+    }
+    libzippp_uint64 nbEntries = readLE(buffer+eocd+10, 2);
+    libzippp_uint64 position = readLE(buffer+eocd+16, 4);
+    if (eocd>=20 && readLE(buffer+eocd-20, 4)==ZIP64_EOCD_LOCATOR_SIGNATURE) {
+        libzippp_uint64 eocd64 = readLE(buffer+eocd-20+8, 8);
+        if (!fitsIn(eocd64, 56, bufferSize) || readLE(buffer+eocd64, 4)!=ZIP64_EOCD_SIGNATURE) { return offsets; }
+        nbEntries = readLE(buffer+eocd64+32, 8);
+        position = readLE(buffer+eocd64+48, 8);
+    }
+    
+    //the count is read from the buffer, never trust it beyond what libzip has found
+    zip_int64_t known = zip_get_num_entries(zipHandle, ZIP_FL_UNCHANGED);
+    if (known<=0) { return offsets; }
+    nbEntries = min(nbEntries, static_cast<libzippp_uint64>(known));
+    offsets.assign(nbEntries, 0);
+    for (libzippp_uint64 i=0 ; i<nbEntries ; ++i) {
+        if (!fitsIn(position, 46, bufferSize) || readLE(buffer+position, 4)!=ZIP_CENTRAL_SIGNATURE) { break; }
+        libzippp_uint64 compressedSize = readLE(buffer+position+20, 4);
+        libzippp_uint64 size = readLE(buffer+position+24, 4);
+        libzippp_uint64 nameLength = readLE(buffer+position+28, 2);
+        libzippp_uint64 extraLength = readLE(buffer+position+30, 2);
+        libzippp_uint64 commentLength = readLE(buffer+position+32, 2);
+        libzippp_uint64 local = readLE(buffer+position+42, 4);
+        libzippp_uint64 next = position+46+nameLength+extraLength+commentLength;
+        if (next>bufferSize) { break; }
+        
+        //zip64 extra field holds the values that did not fit, in this order
+        libzippp_uint64 extra = position+46+nameLength;
+        libzippp_uint64 extraEnd = extra+extraLength;
+        while (extra+4<=extraEnd) {
+            libzippp_uint64 id = readLE(buffer+extra, 2);
+            libzippp_uint64 length = readLE(buffer+extra+2, 2);
+            if (extra+4+length>extraEnd) { break; } //field overruns the extra area
+            if (id==ZIP64_EXTRA_ID) {
+                libzippp_uint64 field = extra+4;
+                libzippp_uint64 end = min(field+length, extraEnd);
+                if (size==0xffffffff && field+8<=end) { field += 8; }
+                if (compressedSize==0xffffffff && field+8<=end) { field += 8; }
+                if (local==0xffffffff && field+8<=end) { local = readLE(buffer+field, 8); }
+                break;
+            }
+            extra += 4+length;
+        }
+        
+        //the data follows the local header, whose name must be the same as the central one
+        if (fitsIn(local, 30, bufferSize) && readLE(buffer+local, 4)==ZIP_LOCAL_SIGNATURE) {
+            libzippp_uint64 localNameLength = readLE(buffer+local+26, 2);
+            libzippp_uint64 localExtraLength = readLE(buffer+local+28, 2);
+            libzippp_uint64 data = local+30+localNameLength+localExtraLength;
+            if (localNameLength==nameLength && fitsIn(local, 30+localNameLength+localExtraLength, bufferSize)
+                && memcmp(buffer+local+30, buffer+position+46, nameLength)==0) {
+                offsets[i] = data;
+            }
+        }
+        position = next;
+    }
+    return offsets;
+}
+
+vector<ZipEntryData> ZipArchive::readEntries(const vector<ZipEntry>& entries, uint nbThreads, const ZipEntryAllocator& allocator, State state) const {
+    if (!isOpen()) { return vector<ZipEntryData>(); }
+    
+    vector<ZipEntryData> results(entries.size());
+    for (size_t i=0 ; i<entries.size() ; ++i) {
+        results[i].entry = entries[i];
+        if (entries[i].zipFile!=this) { results[i].result = LIBZIPPP_ERROR_INVALID_ENTRY; }
+    }
+    
+    //stored entries of a buffer are not read at all
+    bool modified = isMutable();
+    if (isBuffer() && !modified) {
+        {
+            lock_guard<mutex> lock(readerMutex);
+            if (!bufferLocated) {
+                bufferOffsets = locateBufferData();
+                bufferLocated = true;
+            }
+        }
+        const vector<libzippp_uint64>& offsets = bufferOffsets;
+        for (size_t i=0 ; i<results.size() ; ++i) {
+            ZipEntryData& result = results[i];
+            libzippp_uint64 index = result.entry.getIndex();
+            if (result.entry.zipFile==this && index<offsets.size() && offsets[index]>0
+                && result.entry.getCompressionMethod()==ZIP_CM_STORE
+                && result.entry.getEncryptionMethod()==ZIP_EM_NONE
+                && result.entry.getInflatedSize()==result.entry.getSize()
+                && fitsIn(offsets[index], result.entry.getSize(), bufferSize)) {
+                result.data = const_cast<char*>(static_cast<const char*>(bufferData))+offsets[index];
+                result.size = result.entry.getSize();
+                result.view = true;
+                result.result = LIBZIPPP_OK;
+            }
+        }
+    }
+    
+    //pending changes are only visible through the handle of this archive, hence no parallelism
+    if (nbThreads==0) { nbThreads = thread::hardware_concurrency(); }
+    if (nbThreads==0 || modified || entries.size()<2) { nbThreads = 1; }
+    
+    int flag = state==ORIGINAL ? ZIP_FL_UNCHANGED : 0;
+    atomic<size_t> next(0);
+    auto work = [&](zip* handle) {
+        for (size_t i=next++ ; i<results.size() ; i=next++) {
+            ZipEntryData& result = results[i];
+            if (result.view || result.result==LIBZIPPP_ERROR_INVALID_ENTRY) { continue; }
+            if (handle==NULL) {
+                result.result = LIBZIPPP_ERROR_FOPEN_FAILURE;
+            } else {
+                readEntryData(handle, &result, flag, allocator);
+            }
+        }
+    };
+    
+    if (nbThreads==1) {
+        work(zipHandle);
+    } else {
+        //workers (and their handles) are only created again if another number of threads is asked
+        lock_guard<mutex> lock(readerMutex);
+        if (readerPool!=NULL && readerPool->size()!=nbThreads) {
+            delete readerPool;
+            readerPool = NULL;
+        }
+        if (readerPool==NULL) { readerPool = new ReaderPool(this, nbThreads); }
+        readerPool->run(work);
+    }
+    return results;
+}
+
 void* ZipArchive::readEntry(const string& zipEntry, bool asText, State state, libzippp_uint64 size) const {
     ZipEntry entry = getEntry(zipEntry);
     if (entry.isNull()) { return NULL; }
@@ -511,6 +899,76 @@ bool ZipArchive::addEntry(const string& entryName) const {
     return true;
 }
 
+ZipEntryReader::ZipEntryReader(const ZipEntry& zipEntry, ZipArchive::State state) : entry(zipEntry), flag(state==ZipArchive::ORIGINAL ? ZIP_FL_UNCHANGED : 0), zipFile(NULL), position(0) {
+    reopen();
+}
+
+ZipEntryReader::~ZipEntryReader(void) {
+    close();
+}
+
+bool ZipEntryReader::reopen(void) {
+    close();
+    position = 0;
+    if (entry.isNull() || !entry.zipFile->isOpen()) { return false; }
+    
+    zipFile = zip_fopen_index(entry.zipFile->zipHandle, entry.getIndex(), flag);
+    return zipFile!=NULL;
+}
+
+void ZipEntryReader::close(void) {
+    if (zipFile!=NULL) {
+        zip_fclose(zipFile);
+        zipFile = NULL;
+    }
+}
+
+libzippp_int64 ZipEntryReader::read(void* data, libzippp_uint64 size) {
+    if (zipFile==NULL) { return -1; }
+    
+    if (isEnd() || size==0) { return 0; }
+    
+    libzippp_uint64 left = entry.getSize()-position;
+    if (size>left) { size = left; }
+    
+    libzippp_int64 result = zip_fread(zipFile, data, size);
+    if (result>0) { position += result; }
+    return result;
+}
+
+libzippp_int64 ZipEntryReader::skip(libzippp_uint64 size) {
+    libzippp_uint64 start = position;
+    libzippp_uint64 target = size>entry.getSize()-start ? entry.getSize() : start+size;
+    if (!seek(target)) { return -1; }
+    return position-start;
+}
+
+bool ZipEntryReader::seek(libzippp_uint64 offset) {
+    if (zipFile==NULL) { return false; }
+    if (offset>entry.getSize()) { return false; }
+    if (offset==position) { return true; }
+    
+    //libzip only seeks in data that does not need to be inflated or decrypted. A failed
+    //seek leaves its error on the file, which fails every read after it, hence reopen
+    if (entry.getCompressionMethod()==ZIP_CM_STORE && entry.getEncryptionMethod()==ZIP_EM_NONE) {
+        if (zip_fseek(zipFile, offset, SEEK_SET)==0) {
+            position = offset;
+            return true;
+        }
+        if (!reopen()) { return false; }
+    }
+    
+    if (offset<position && !reopen()) { return false; }
+    
+    char buffer[65536];
+    while (position<offset) {
+        libzippp_uint64 chunk = offset-position;
+        if (chunk>sizeof(buffer)) { chunk = sizeof(buffer); }
+        if (read(buffer, chunk)<=0) { return false; }
+    }
+    return true;
+}
+
 int ZipArchive::readEntry(const ZipEntry& zipEntry, std::ofstream& ofOutput, State state, libzippp_uint64 chunksize) const {
     if (!ofOutput.is_open()) { return LIBZIPPP_ERROR_INVALID_PARAMETER; }
     if (!isOpen()) { return LIBZIPPP_ERROR_NOT_OPEN; }
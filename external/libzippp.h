@@ -39,9 +39,13 @@
 #include <cstdio>
 #include <string>
 #include <vector>
+#include <functional>
+#include <mutex>
 
 //defined in libzip
 struct zip;
+struct zip_source;
+struct zip_error;
 
 #define DIRECTORY_SEPARATOR '/'
 #define IS_DIRECTORY(str) ((str).length()>0 && (str)[(str).length()-1]==DIRECTORY_SEPARATOR)
@@ -94,12 +98,27 @@ typedef unsigned int uint;
 
 namespace libzippp {
     class ZipEntry;
+    struct ZipEntryData;
+    class ZipEntryReader;
+    
+    /**
+     * Provides the buffer (of at least the given size) in which an entry is read
+     * by ZipArchive::readEntries. It may be called from any worker thread.
+     */
+    typedef std::function<char*(const ZipEntry& entry, libzippp_uint64 size)> ZipEntryAllocator;
+    
+    /**
+     * Reads size bytes at the given offset of the archive in data and returns true on success.
+     * It is called from any thread when the archive is read with ZipArchive::readEntries.
+     */
+    typedef std::function<bool(libzippp_uint64 offset, void* data, libzippp_uint64 size)> ZipSourceReader;
     
     /**
      * Represents a ZIP archive. This class provides useful methods to handle an archive
      * content. It is simply a wrapper around libzip.
      */
     class LIBZIPPP_API ZipArchive {
+    friend class ZipEntryReader;
     public:
         
         /**
@@ -134,6 +153,21 @@ namespace libzippp {
          * http://nih.at/listarchive/libzip-discuss/msg00219.html
          */
         explicit ZipArchive(const std::string& zipPath, const std::string& password="");
+        
+        /**
+         * Creates a new ZipArchive backed by the given in-memory buffer instead of a file.
+         * The buffer is not copied, hence it must outlive the ZipArchive (or at least until
+         * it is closed). Such an archive can only be open in READ_ONLY mode and has an
+         * empty path.
+         */
+        ZipArchive(const void* data, libzippp_uint64 size, const std::string& password="");
+        
+        /**
+         * Creates a new ZipArchive of the given size whose content is pulled from the reader
+         * as libzip needs it, i.e, only the central directory and the entries being read.
+         * Such an archive can only be open in READ_ONLY mode and has an empty path.
+         */
+        ZipArchive(const ZipSourceReader& reader, libzippp_uint64 size, const std::string& password="");
         virtual ~ZipArchive(void); //commit all the changes if open
         
         /**
@@ -141,6 +175,16 @@ namespace libzippp {
          */
         std::string getPath(void) const { return path; }
         
+        /**
+         * Returns true if the ZipArchive reads from an in-memory buffer.
+         */
+        inline bool isBuffer(void) const { return bufferData!=NULL; }
+        
+        /**
+         * Returns true if the ZipArchive reads from a ZipSourceReader.
+         */
+        inline bool isSource(void) const { return static_cast<bool>(sourceReader); }
+        
         /**
          * Open the ZipArchive with the given mode. This method will return true if the operation
          * is successful, false otherwise. If the OpenMode is NOT_OPEN an invalid_argument
@@ -298,6 +342,25 @@ namespace libzippp {
          * The method doesn't close the ofstream after the extraction.
          */
         int readEntry(const ZipEntry& zipEntry, std::ofstream& ofOutput, State state=CURRENT, libzippp_uint64 chunksize=DEFAULT_CHUNK_SIZE) const;
+        
+        /**
+         * Reads the content of all the specified entries in parallel and returns them in the
+         * same order. Each worker thread reads through its own libzip handle (opened from the
+         * same path or the same in-memory buffer), the ZipArchive itself is only used to get
+         * the path/buffer and the password, hence it must be open but is not modified.
+         * The worker threads, their handles and the location of the entries in the buffer are
+         * kept until the archive is closed, so that reading the entries in several calls does
+         * not parse the central directory again.
+         * If nbThreads is 0, all the hardware threads are used.
+         * Entries that are STORED (not compressed nor encrypted) in an in-memory archive are not
+         * copied at all: the returned data points directly in the buffer of the archive and
+         * ZipEntryData::isView is true. All the other entries are read in a buffer provided by
+         * the allocator or, if none is provided, allocated with new[] (to be deleted with delete[]
+         * by the developer). Buffers provided by the allocator are returned in ZipEntryData::data
+         * even if the read has failed so that they can be reused.
+         * If the archive is not open, an empty vector will be returned.
+         */
+        std::vector<ZipEntryData> readEntries(const std::vector<ZipEntry>& entries, uint nbThreads=0, const ZipEntryAllocator& allocator=ZipEntryAllocator(), State state=CURRENT) const;
 
         /**
          * Deletes the specified entry from the zip file. If the entry is a folder, all its
@@ -379,14 +442,37 @@ namespace libzippp {
         inline OpenMode getMode(void) const { return mode; }
 
     private:
+        class ReaderPool;
+        
         std::string path;
+        const void* bufferData;
+        libzippp_uint64 bufferSize;
+        ZipSourceReader sourceReader;
         zip* zipHandle;
         OpenMode mode;
         std::string password;
         
+        //workers of readEntries and offsets of the data in the buffer, kept until the archive is closed
+        mutable std::mutex readerMutex;
+        mutable ReaderPool* readerPool;
+        mutable std::vector<libzippp_uint64> bufferOffsets;
+        mutable bool bufferLocated;
+        
         //generic method to create ZipEntry
         ZipEntry createEntry(struct zip_stat* stat) const;
         
+        //opens another read-only libzip handle on the same file or buffer
+        zip* openHandle(void) const;
+        
+        //libzip source over the buffer or the reader
+        struct zip_source* createSource(struct zip_error* error) const;
+        
+        //offsets of the data of the entries in the buffer, by index (0 if it cannot be located)
+        std::vector<libzippp_uint64> locateBufferData(void) const;
+        
+        //stops the workers of readEntries and forgets the offsets
+        void releaseReaders(void);
+        
         //prevent copy across functions
         ZipArchive(const ZipArchive& zf);
         ZipArchive& operator=(const ZipArchive&);
@@ -398,6 +484,7 @@ namespace libzippp {
      */
     class LIBZIPPP_API ZipEntry {
     friend class ZipArchive;
+    friend class ZipEntryReader;
     public:
         /**
          * Creates a new null-ZipEntry. Only a ZipArchive will create a valid ZipEntry
@@ -523,6 +610,112 @@ namespace libzippp {
         ZipEntry(const ZipArchive* zipFile, const std::string& name, libzippp_uint64 index, time_t time, libzippp_uint16 compMethod, libzippp_uint16 encMethod, libzippp_uint64 size, libzippp_uint64 sizeComp, int crc) : 
                 zipFile(zipFile), name(name), index(index), time(time), compressionMethod(compMethod), encryptionMethod(encMethod), size(size), sizeComp(sizeComp), crc(crc) {}
     };
+    
+    /**
+     * Content of an entry read by ZipArchive::readEntries.
+     */
+    struct LIBZIPPP_API ZipEntryData {
+        ZipEntryData(void) : data(NULL), size(0), view(false), result(LIBZIPPP_ERROR_UNKNOWN), readStarted(0), readEnded(0) {}
+        
+        /**
+         * Returns true if the data points in the buffer of the archive (not owned).
+         */
+        inline bool isView(void) const { return view; }
+        
+        /**
+         * Returns true if the entry has been read successfully.
+         */
+        inline bool isOk(void) const { return result==LIBZIPPP_OK; }
+        
+        ZipEntry entry;
+        char* data;
+        libzippp_uint64 size;
+        bool view;
+        
+        /**
+         * LIBZIPPP_OK or LIBZIPPP_ERROR_FOPEN_FAILURE, LIBZIPPP_ERROR_FREAD_FAILURE,
+         * LIBZIPPP_ERROR_MEMORY_ALLOCATION, LIBZIPPP_ERROR_INVALID_ENTRY.
+         */
+        int result;
+        
+        /**
+         * When the entry has been read (inflated), in nanoseconds of std::chrono::steady_clock
+         * since its epoch. Both are zero for views as nothing is read.
+         */
+        libzippp_uint64 readStarted;
+        libzippp_uint64 readEnded;
+    };
+    
+    /**
+     * Reads the content of a ZipEntry gradually, the caller pulls as many bytes as needed.
+     * This is useful when only the beginning of an entry is needed (i.e, headers of a file),
+     * the rest of the entry is never inflated.
+     * The ZipArchive of the entry must stay open as long as the reader is used.
+     */
+    class LIBZIPPP_API ZipEntryReader {
+    public:
+        /**
+         * Opens the entry for reading. Use isOpen() to check if the entry could be opened.
+         */
+        explicit ZipEntryReader(const ZipEntry& entry, ZipArchive::State state=ZipArchive::CURRENT);
+        virtual ~ZipEntryReader(void);
+        
+        /**
+         * Returns true if the entry is open for reading.
+         */
+        inline bool isOpen(void) const { return zipFile!=NULL; }
+        
+        /**
+         * Returns the entry being read.
+         */
+        inline const ZipEntry& getEntry(void) const { return entry; }
+        
+        /**
+         * Returns the current position in the (uncompressed) content of the entry.
+         */
+        inline libzippp_uint64 tell(void) const { return position; }
+        
+        /**
+         * Returns true if the end of the entry has been reached.
+         */
+        inline bool isEnd(void) const { return position>=entry.getSize(); }
+        
+        /**
+         * Reads at most size bytes in data and returns the number of bytes read, 0 at the end
+         * of the entry and -1 if the reader is not open or if zip_fread() has failed.
+         */
+        libzippp_int64 read(void* data, libzippp_uint64 size);
+        
+        /**
+         * Skips size bytes and returns the number of bytes skipped or -1 on failure.
+         * Compressed entries are inflated up to the new position.
+         */
+        libzippp_int64 skip(libzippp_uint64 size);
+        
+        /**
+         * Moves to the given position and returns true on success. The seek is done directly
+         * where the compression method allows it (i.e, stored entries), otherwise the entry is
+         * inflated up to the new position, starting over from the beginning when moving backward.
+         */
+        bool seek(libzippp_uint64 offset);
+        
+        /**
+         * Closes the reader, this is done automatically by the destructor.
+         */
+        void close(void);
+        
+    private:
+        ZipEntry entry;
+        int flag;
+        struct zip_file* zipFile;
+        libzippp_uint64 position;
+        
+        bool reopen(void);
+        
+        //prevent copy across functions
+        ZipEntryReader(const ZipEntryReader& reader);
+        ZipEntryReader& operator=(const ZipEntryReader&);
+    };
 }
 
 #endif
@@ -21,10 +21,25 @@
 #include <unordered_set>
 #include <cerrno>
 #include <cstring>
+#include <cctype>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include <zlib.h>
 
 #include "mine.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define MINE_X86 1
+#   include <cpuid.h>
+#   include <immintrin.h>
+#else
+#   define MINE_X86 0
+#endif
+
 using namespace mine;
 #ifndef MINE_VERSION
 #define MINE_VERSION "1.1.4"
@@ -88,18 +103,12 @@ ByteArray MineCommon::generateRandomBytes(const std::size_t len) noexcept
 
 std::string MineCommon::byteArrayToRawString(const ByteArray& input) noexcept
 {
-    std::ostringstream ss;
-    std::copy(input.begin(), input.end(), std::ostream_iterator<char>(ss));
-    return ss.str();
+    return std::string(input.begin(), input.end());
 }
 
 ByteArray MineCommon::rawStringToByteArray(const std::string& str) noexcept
 {
-    ByteArray byteArr;
-    for (char c : str) {
-        byteArr.push_back(static_cast<byte>(c));
-    }
-    return byteArr;
+    return ByteArray(str.begin(), str.end());
 }
 
 std::string MineCommon::version() noexcept
@@ -168,6 +177,213 @@ const std::unordered_map<byte, byte> Base64::kDecodeMap = {
    {0x3D, 0x40}
 };
 
+const byte Base64::kDecodeTable[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x80, 0x80, 0x80, 0x80, 0x80, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x80, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0x40, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+namespace {
+
+using QuadDecoder = std::size_t (*)(const byte* input, std::size_t len, byte** output);
+
+///
+/// Decodes quads as long as they are free of whitespace and padding, returns
+/// number of input bytes consumed and moves output ahead
+///
+std::size_t decodeQuadsScalar(const byte* input, std::size_t len, byte** output)
+{
+    byte* out = *output;
+    std::size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        const uint32_t b0 = Base64::kDecodeTable[input[i]];
+        const uint32_t b1 = Base64::kDecodeTable[input[i + 1]];
+        const uint32_t b2 = Base64::kDecodeTable[input[i + 2]];
+        const uint32_t b3 = Base64::kDecodeTable[input[i + 3]];
+        // padding, whitespace and invalid characters all have bit 6 or 7 set
+        if ((b0 | b1 | b2 | b3) & 0xc0) {
+            break;
+        }
+        const uint32_t bits = (b0 << 18) | (b1 << 12) | (b2 << 6) | b3;
+        out[0] = static_cast<byte>(bits >> 16);
+        out[1] = static_cast<byte>(bits >> 8);
+        out[2] = static_cast<byte>(bits);
+        out += 3;
+    }
+    *output = out;
+    return i;
+}
+
+#if MINE_X86
+
+///
+/// Vectorized lookup and packing, see W. Mula, D. Lemire
+/// "Faster Base64 Encoding and Decoding using AVX2 Instructions" (2018)
+/// Each 16 characters are validated and translated to 6-bit values using
+/// nibble lookups, then packed to 12 bytes. Stores are 16 bytes wide so
+/// we stop while the output still has enough room for that
+///
+__attribute__((target("ssse3")))
+std::size_t decodeQuadsSsse3(const byte* input, std::size_t len, byte** output)
+{
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    byte* out = *output;
+    std::size_t i = 0;
+    for (; i + 24 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask2F);
+        const __m128i lo = _mm_shuffle_epi8(lutLo, _mm_and_si128(in, mask2F));
+        const __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+            break;
+        }
+        const __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask2F), hiNibbles));
+        in = _mm_add_epi8(in, roll);
+        in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+        in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(in, pack));
+        out += 12;
+    }
+    *output = out;
+    return i + decodeQuadsScalar(input + i, len - i, output);
+}
+
+///
+/// Same as decodeQuadsSsse3() on 32 characters at a time
+///
+__attribute__((target("avx2")))
+std::size_t decodeQuadsAvx2(const byte* input, std::size_t len, byte** output)
+{
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    byte* out = *output;
+    std::size_t i = 0;
+    for (; i + 48 <= len; i += 32) {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+        const __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+        const __m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(in, mask2F));
+        const __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+        const __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask2F), hiNibbles));
+        in = _mm256_add_epi8(in, roll);
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(in, pack), lanes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), in);
+        out += 24;
+    }
+    *output = out;
+    return i + decodeQuadsSsse3(input + i, len - i, output);
+}
+
+#endif // MINE_X86
+
+QuadDecoder selectQuadDecoder()
+{
+#if MINE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return decodeQuadsAvx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return decodeQuadsSsse3;
+    }
+#endif
+    return decodeQuadsScalar;
+}
+
+} // namespace
+
+///
+/// Bulk of the input goes through vectorized quad decoder, whatever it
+/// cannot handle (whitespace, padding and errors) is decoded here one
+/// character at a time. Using example from encode()
+/// Bits              01100001   01100010  01100011
+/// 24-bit stream:    011000   010110   001001   100011
+/// result indices     24        22       9        35
+///
+std::size_t Base64::decode(const char* data, std::size_t len, byte* output, std::size_t* consumed)
+{
+    static const QuadDecoder decodeQuads = selectQuadDecoder();
+
+    const byte* input = reinterpret_cast<const byte*>(data);
+    byte* out = output;
+    byte quad[4];
+    int n = 0;
+    std::size_t quadStart = 0;
+    std::size_t i = 0;
+    while (i < len) {
+        if (n == 0) {
+            i += decodeQuads(input + i, len - i, &out);
+            if (i >= len) {
+                break;
+            }
+            quadStart = i;
+        }
+        const byte b = kDecodeTable[input[i++]];
+        if (b == kWhitespace) {
+            continue;
+        }
+        if (b == kInvalid) {
+            throw std::invalid_argument("Invalid base64 encoding: Invalid character at " + std::to_string(i - 1));
+        }
+        quad[n++] = b;
+        if (n < 4) {
+            continue;
+        }
+        n = 0;
+        if (quad[0] == kPadding || quad[1] == kPadding) {
+            throw std::invalid_argument("Invalid base64 encoding: No data available");
+        }
+        *out++ = static_cast<byte>(quad[0] << 2 | quad[1] >> 4);
+        if (quad[2] == kPadding) {
+            if (quad[3] != kPadding) {
+                throw std::invalid_argument("Invalid base64 encoding: Invalid padding");
+            }
+            continue;
+        }
+        *out++ = static_cast<byte>(quad[1] << 4 | quad[2] >> 2);
+        if (quad[3] != kPadding) {
+            *out++ = static_cast<byte>(quad[2] << 6 | quad[3]);
+        }
+    }
+    if (consumed != nullptr) {
+        *consumed = n == 0 ? len : quadStart;
+    } else if (n != 0) {
+        throw std::invalid_argument("Invalid base64 encoding: Incomplete data");
+    }
+    return static_cast<std::size_t>(out - output);
+}
+
 #define MINE_PROFILING 0
 
 #if MINE_PROFILING
@@ -247,12 +463,20 @@ AES::AES(const AES& other)
     if (&other != this) {
         m_key = other.m_key;
         m_keySchedule = other.m_keySchedule;
+        m_backend = other.m_backend;
+        m_roundKeys = other.m_roundKeys;
+        m_threadCount = other.m_threadCount;
+        m_workers = other.m_workers;
     }
 }
 
 AES::AES(const AES&& other) :
     m_key(std::move(other.m_key)),
-    m_keySchedule(std::move(other.m_keySchedule))
+    m_keySchedule(std::move(other.m_keySchedule)),
+    m_backend(other.m_backend),
+    m_roundKeys(other.m_roundKeys),
+    m_threadCount(other.m_threadCount),
+    m_workers(other.m_workers)
 {
 }
 
@@ -261,6 +485,10 @@ AES& AES::operator=(const AES& other)
     if (&other != this) {
         m_key = other.m_key;
         m_keySchedule = other.m_keySchedule;
+        m_backend = other.m_backend;
+        m_roundKeys = other.m_roundKeys;
+        m_threadCount = other.m_threadCount;
+        m_workers = other.m_workers;
     }
     return *this;
 }
@@ -277,6 +505,47 @@ void AES::setKey(const ByteArray& key)
     }
     m_key = key;
     m_keySchedule = keyExpansion(&m_key);
+    m_roundKeys = prepareRoundKeys(m_keySchedule, m_key.size(), m_backend);
+}
+
+namespace {
+
+AES::Profiler& activeProfiler()
+{
+    static AES::Profiler profiler;
+    return profiler;
+}
+
+inline std::chrono::steady_clock::time_point profilingNow()
+{
+    return activeProfiler() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+}
+
+inline void endRuntimeProfiling(const char* phase, std::chrono::steady_clock::time_point started, std::size_t bytes)
+{
+    if (activeProfiler()) {
+        activeProfiler()(phase, started, std::chrono::steady_clock::now(), bytes);
+    }
+}
+
+} // namespace
+
+void AES::setProfiler(const Profiler& profiler)
+{
+    activeProfiler() = profiler;
+}
+
+void AES::setThreadCount(std::size_t threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    threadCount = std::max<std::size_t>(threadCount, 1);
+    if (threadCount != m_threadCount) {
+        // calling thread deciphers first segment
+        m_workers = threadCount > 1 ? std::make_shared<Workers>(threadCount - 1) : nullptr;
+    }
+    m_threadCount = threadCount;
 }
 
 void AES::printBytes(const ByteArray& b)
@@ -332,7 +601,7 @@ AES::KeySchedule AES::keyExpansion(const Key* key)
     uint8_t Nk = kKeyParams.at(keySize)[0],
             Nr = kKeyParams.at(keySize)[1];
 
-    KeySchedule words;//(kNb * (Nr+1));
+    KeySchedule words = {};// kNb * (Nr+1) are used
 
     uint8_t i = 0;
     // copy main key as is for the first round
@@ -394,7 +663,7 @@ AES::KeySchedule AES::keyExpansion(const Key* key)
 /// | 0c^cc   9d^9e   8d^15   fa^dd |
 /// [ fe^fe   ef^ea   cc^02   b2^dc ]
 ///
-void AES::addRoundKey(State* state, KeySchedule* keySchedule, int round)
+void AES::addRoundKey(State* state, const KeySchedule* keySchedule, int round)
 {
 #if MINE_PROFILING
     auto started = std::chrono::steady_clock::now();
@@ -405,9 +674,9 @@ void AES::addRoundKey(State* state, KeySchedule* keySchedule, int round)
         for (std::size_t j = 0; j < kNb; ++j) {
 #if MINE_PROFILING
     auto started2 = std::chrono::steady_clock::now();
-    std::cout << ((*state)[i][j] & 0xff) << " ^= " << ((*keySchedule)[iR2][j] & 0xff);
+    std::cout << ((*state)[i][j] & 0xff) << " ^= " << (keySchedule->at(iR2)[j] & 0xff);
 #endif
-            (*state)[i][j] ^= (*keySchedule)[iR2][j];
+            (*state)[i][j] ^= keySchedule->at(iR2)[j];
 #if MINE_PROFILING
     std::cout << " = " << ((*state)[i][j] & 0xff) << std::endl;
     endProfiling(started2, "add single round");
@@ -678,7 +947,7 @@ ByteArray* AES::xorWithRange(ByteArray* input, const ByteArray::const_iterator&
     return input;
 }
 
-ByteArray AES::encryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, KeySchedule* keySchedule)
+ByteArray AES::encryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, const KeySchedule* keySchedule)
 {
 
     if (key == nullptr || keySchedule == nullptr) {
@@ -688,23 +957,44 @@ ByteArray AES::encryptSingleBlock(const ByteArray::const_iterator& range, const
     State state;
     initState(&state, range);
 
-    const uint8_t kTotalRounds = kKeyParams.at(key->size())[1];
+    encryptState(&state, keySchedule, kKeyParams.at(key->size())[1]);
+
+    return stateToByteArray(&state);
+
+}
+
+ByteArray AES::decryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, const KeySchedule* keySchedule)
+{
+
+    if (key == nullptr || keySchedule == nullptr) {
+        throw std::invalid_argument("AES raw decryption requires key");
+    }
+
+    State state;
+    initState(&state, range);
+
+    decryptState(&state, keySchedule, kKeyParams.at(key->size())[1]);
+
+    return stateToByteArray(&state);
+}
 
+void AES::encryptState(State* state, const KeySchedule* keySchedule, uint8_t totalRounds)
+{
     int round = 0;
 
     // initial round
-    addRoundKey(&state, keySchedule, round++);
+    addRoundKey(state, keySchedule, round++);
 
 
 #if MINE_PROFILING
     auto started = std::chrono::steady_clock::now();
 #endif
     // intermediate round
-    for (; round < kTotalRounds; ++round) {
-        subBytes(&state);
-        shiftRows(&state);
-        mixColumns(&state);
-        addRoundKey(&state, keySchedule, round);
+    for (; round < totalRounds; ++round) {
+        subBytes(state);
+        shiftRows(state);
+        mixColumns(state);
+        addRoundKey(state, keySchedule, round);
     }
 
 #if MINE_PROFILING
@@ -712,56 +1002,524 @@ ByteArray AES::encryptSingleBlock(const ByteArray::const_iterator& range, const
 #endif
 
     // final round
-    subBytes(&state);
-    shiftRows(&state);
-    addRoundKey(&state, keySchedule, round++);
+    subBytes(state);
+    shiftRows(state);
+    addRoundKey(state, keySchedule, round++);
+}
 
-    return stateToByteArray(&state);
+void AES::decryptState(State* state, const KeySchedule* keySchedule, uint8_t totalRounds)
+{
+    int round = totalRounds;
 
+    // initial round
+    addRoundKey(state, keySchedule, round--);
+
+    // intermediate round
+    for (; round > 0; --round) {
+        invShiftRows(state);
+        invSubBytes(state);
+        addRoundKey(state, keySchedule, round);
+        invMixColumns(state);
+    }
+
+    // final round
+    invShiftRows(state);
+    invSubBytes(state);
+    addRoundKey(state, keySchedule, round);
 }
 
-ByteArray AES::decryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, KeySchedule* keySchedule)
+namespace {
+
+///
+/// Lookup tables for Backend::TTable, each entry of Te0 is the column
+/// MixColumns produces for S-Box output of the byte at row 0, i.e, {02}s, s, s, {03}s
+/// and Te1..Te3 are the same column rotated for rows 1..3 (Td* are for inverse cipher)
+/// They are generated from S-Boxes on first use rather than hard-coded
+///
+struct TTables {
+    uint32_t te[4][256];
+    uint32_t td[4][256];
+
+    TTables(const byte* sBox, const byte* sBoxInverse)
+    {
+        for (int x = 0; x < 256; ++x) {
+            const uint32_t s = sBox[x];
+            const uint32_t s2 = mul(s, 2);
+            const uint32_t e = (s2 << 24) | (s << 16) | (s << 8) | (s2 ^ s);
+
+            const uint32_t si = sBoxInverse[x];
+            const uint32_t d = (mul(si, 0x0e) << 24) | (mul(si, 0x09) << 16) | (mul(si, 0x0d) << 8) | mul(si, 0x0b);
+            for (int r = 0; r < 4; ++r) {
+                te[r][x] = r == 0 ? e : (e >> (8 * r)) | (e << (32 - 8 * r));
+                td[r][x] = r == 0 ? d : (d >> (8 * r)) | (d << (32 - 8 * r));
+            }
+        }
+    }
+
+    static uint32_t mul(uint32_t x, uint32_t y)
+    {
+        uint32_t result = 0;
+        for (; y; y >>= 1) {
+            if (y & 1) {
+                result ^= x;
+            }
+            x = (x << 1) ^ ((x & 0x80) ? 0x11b : 0);
+        }
+        return result;
+    }
+};
+
+inline uint32_t loadWord(const byte* p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+inline void storeWord(uint32_t w, byte* p)
 {
+    p[0] = static_cast<byte>(w >> 24);
+    p[1] = static_cast<byte>(w >> 16);
+    p[2] = static_cast<byte>(w >> 8);
+    p[3] = static_cast<byte>(w);
+}
 
-    if (key == nullptr || keySchedule == nullptr) {
-        throw std::invalid_argument("AES raw decryption requires key");
+const TTables& tTables(const byte* sBox, const byte* sBoxInverse)
+{
+    static const TTables tables(sBox, sBoxInverse);
+    return tables;
+}
+
+} // namespace
+
+AES::RoundKeys AES::prepareRoundKeys(const KeySchedule& keySchedule, std::size_t keySize, Backend backend)
+{
+    RoundKeys roundKeys;
+    roundKeys.backend = backend;
+    roundKeys.rounds = kKeyParams.at(keySize)[1];
+    roundKeys.schedule = keySchedule;
+
+    const int nr = roundKeys.rounds;
+    const int nWords = kNb * (nr + 1);
+    for (int i = 0; i < nWords; ++i) {
+        roundKeys.encWords[i] = loadWord(keySchedule[i].data());
     }
 
-    State state;
-    initState(&state, range);
+    // equivalent inverse cipher, see Sec. 5.3.5
+    const TTables& t = tTables(kSBox, kSBoxInverse);
+    for (int round = 0; round <= nr; ++round) {
+        for (int i = 0; i < kNb; ++i) {
+            uint32_t w = roundKeys.encWords[(nr - round) * kNb + i];
+            if (round > 0 && round < nr) {
+                // InvMixColumns(w) = Td(SubBytes(w)) since InvSubBytes cancels out
+                w = t.td[0][kSBox[w >> 24]] ^ t.td[1][kSBox[(w >> 16) & 0xff]] ^
+                    t.td[2][kSBox[(w >> 8) & 0xff]] ^ t.td[3][kSBox[w & 0xff]];
+            }
+            roundKeys.decWords[round * kNb + i] = w;
+            storeWord(w, &roundKeys.decBytes[(round * kNb + i) * 4]);
+        }
+    }
+    return roundKeys;
+}
 
-    const uint8_t kTotalRounds = kKeyParams.at(key->size())[1];
+void AES::encryptBlockTTable(const byte* input, byte* output, const RoundKeys* roundKeys)
+{
+    const TTables& t = tTables(kSBox, kSBoxInverse);
+    const uint32_t* rk = roundKeys->encWords.data();
+
+    uint32_t s0 = loadWord(input) ^ rk[0];
+    uint32_t s1 = loadWord(input + 4) ^ rk[1];
+    uint32_t s2 = loadWord(input + 8) ^ rk[2];
+    uint32_t s3 = loadWord(input + 12) ^ rk[3];
+
+    for (int round = 1; round < roundKeys->rounds; ++round) {
+        rk += 4;
+        const uint32_t t0 = t.te[0][s0 >> 24] ^ t.te[1][(s1 >> 16) & 0xff] ^ t.te[2][(s2 >> 8) & 0xff] ^ t.te[3][s3 & 0xff] ^ rk[0];
+        const uint32_t t1 = t.te[0][s1 >> 24] ^ t.te[1][(s2 >> 16) & 0xff] ^ t.te[2][(s3 >> 8) & 0xff] ^ t.te[3][s0 & 0xff] ^ rk[1];
+        const uint32_t t2 = t.te[0][s2 >> 24] ^ t.te[1][(s3 >> 16) & 0xff] ^ t.te[2][(s0 >> 8) & 0xff] ^ t.te[3][s1 & 0xff] ^ rk[2];
+        const uint32_t t3 = t.te[0][s3 >> 24] ^ t.te[1][(s0 >> 16) & 0xff] ^ t.te[2][(s1 >> 8) & 0xff] ^ t.te[3][s2 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
 
-    int round = kTotalRounds;
+    // final round has no MixColumns
+    rk += 4;
+    const uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; ++c) {
+        const uint32_t w = (static_cast<uint32_t>(kSBox[s[c] >> 24]) << 24) |
+                           (static_cast<uint32_t>(kSBox[(s[(c + 1) % 4] >> 16) & 0xff]) << 16) |
+                           (static_cast<uint32_t>(kSBox[(s[(c + 2) % 4] >> 8) & 0xff]) << 8) |
+                           kSBox[s[(c + 3) % 4] & 0xff];
+        storeWord(w ^ rk[c], output + (c * 4));
+    }
+}
 
-    // initial round
-    addRoundKey(&state, keySchedule, round--);
+void AES::decryptBlockTTable(const byte* input, byte* output, const RoundKeys* roundKeys)
+{
+    const TTables& t = tTables(kSBox, kSBoxInverse);
+    const uint32_t* rk = roundKeys->decWords.data();
+
+    uint32_t s0 = loadWord(input) ^ rk[0];
+    uint32_t s1 = loadWord(input + 4) ^ rk[1];
+    uint32_t s2 = loadWord(input + 8) ^ rk[2];
+    uint32_t s3 = loadWord(input + 12) ^ rk[3];
+
+    for (int round = 1; round < roundKeys->rounds; ++round) {
+        rk += 4;
+        const uint32_t t0 = t.td[0][s0 >> 24] ^ t.td[1][(s3 >> 16) & 0xff] ^ t.td[2][(s2 >> 8) & 0xff] ^ t.td[3][s1 & 0xff] ^ rk[0];
+        const uint32_t t1 = t.td[0][s1 >> 24] ^ t.td[1][(s0 >> 16) & 0xff] ^ t.td[2][(s3 >> 8) & 0xff] ^ t.td[3][s2 & 0xff] ^ rk[1];
+        const uint32_t t2 = t.td[0][s2 >> 24] ^ t.td[1][(s1 >> 16) & 0xff] ^ t.td[2][(s0 >> 8) & 0xff] ^ t.td[3][s3 & 0xff] ^ rk[2];
+        const uint32_t t3 = t.td[0][s3 >> 24] ^ t.td[1][(s2 >> 16) & 0xff] ^ t.td[2][(s1 >> 8) & 0xff] ^ t.td[3][s0 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
 
-    // intermediate round
-    for (; round > 0; --round) {
-        invShiftRows(&state);
-        invSubBytes(&state);
-        addRoundKey(&state, keySchedule, round);
-        invMixColumns(&state);
+    // final round has no InvMixColumns
+    rk += 4;
+    const uint32_t s[4] = { s0, s1, s2, s3 };
+    for (int c = 0; c < 4; ++c) {
+        const uint32_t w = (static_cast<uint32_t>(kSBoxInverse[s[c] >> 24]) << 24) |
+                           (static_cast<uint32_t>(kSBoxInverse[(s[(c + 3) % 4] >> 16) & 0xff]) << 16) |
+                           (static_cast<uint32_t>(kSBoxInverse[(s[(c + 2) % 4] >> 8) & 0xff]) << 8) |
+                           kSBoxInverse[s[(c + 1) % 4] & 0xff];
+        storeWord(w ^ rk[c], output + (c * 4));
     }
+}
 
-    // final round
-    invShiftRows(&state);
-    invSubBytes(&state);
-    addRoundKey(&state, keySchedule, round);
+#if MINE_X86
 
-    return stateToByteArray(&state);
+__attribute__((target("aes,sse2")))
+void AES::encryptBlockAesNi(const byte* input, byte* output, const RoundKeys* roundKeys)
+{
+    // key schedule is contiguous array of bytes in the order AES-NI expects
+    const __m128i* rk = reinterpret_cast<const __m128i*>(roundKeys->schedule.data());
+    const int nr = roundKeys->rounds;
+    __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(input)), _mm_loadu_si128(rk));
+    for (int round = 1; round < nr; ++round) {
+        block = _mm_aesenc_si128(block, _mm_loadu_si128(rk + round));
+    }
+    block = _mm_aesenclast_si128(block, _mm_loadu_si128(rk + nr));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output), block);
+}
+
+///
+/// CBC decryption does not depend on previous plain block so we keep
+/// four blocks in flight to hide the latency of aesdec
+///
+__attribute__((target("aes,sse2")))
+void AES::decryptBlocksAesNi(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys)
+{
+    const __m128i* rk = reinterpret_cast<const __m128i*>(roundKeys->decBytes.data());
+    const int nr = roundKeys->rounds;
+    const __m128i* in = reinterpret_cast<const __m128i*>(input);
+    __m128i* out = reinterpret_cast<__m128i*>(output);
+    __m128i iv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev));
+
+    std::size_t i = 0;
+    for (; i + 4 <= nBlocks; i += 4) {
+        const __m128i c0 = _mm_loadu_si128(in + i);
+        const __m128i c1 = _mm_loadu_si128(in + i + 1);
+        const __m128i c2 = _mm_loadu_si128(in + i + 2);
+        const __m128i c3 = _mm_loadu_si128(in + i + 3);
+        __m128i k = _mm_loadu_si128(rk);
+        __m128i b0 = _mm_xor_si128(c0, k);
+        __m128i b1 = _mm_xor_si128(c1, k);
+        __m128i b2 = _mm_xor_si128(c2, k);
+        __m128i b3 = _mm_xor_si128(c3, k);
+        for (int round = 1; round < nr; ++round) {
+            k = _mm_loadu_si128(rk + round);
+            b0 = _mm_aesdec_si128(b0, k);
+            b1 = _mm_aesdec_si128(b1, k);
+            b2 = _mm_aesdec_si128(b2, k);
+            b3 = _mm_aesdec_si128(b3, k);
+        }
+        k = _mm_loadu_si128(rk + nr);
+        _mm_storeu_si128(out + i, _mm_xor_si128(_mm_aesdeclast_si128(b0, k), iv));
+        _mm_storeu_si128(out + i + 1, _mm_xor_si128(_mm_aesdeclast_si128(b1, k), c0));
+        _mm_storeu_si128(out + i + 2, _mm_xor_si128(_mm_aesdeclast_si128(b2, k), c1));
+        _mm_storeu_si128(out + i + 3, _mm_xor_si128(_mm_aesdeclast_si128(b3, k), c2));
+        iv = c3;
+    }
+    for (; i < nBlocks; ++i) {
+        const __m128i c = _mm_loadu_si128(in + i);
+        __m128i b = _mm_xor_si128(c, _mm_loadu_si128(rk));
+        for (int round = 1; round < nr; ++round) {
+            b = _mm_aesdec_si128(b, _mm_loadu_si128(rk + round));
+        }
+        _mm_storeu_si128(out + i, _mm_xor_si128(_mm_aesdeclast_si128(b, _mm_loadu_si128(rk + nr)), iv));
+        iv = c;
+    }
+}
+
+#else
+
+void AES::encryptBlockAesNi(const byte*, byte*, const RoundKeys*)
+{
+    throw std::invalid_argument("AES-NI is not supported on this platform");
+}
+
+void AES::decryptBlocksAesNi(const byte*, std::size_t, const byte*, byte*, const RoundKeys*)
+{
+    throw std::invalid_argument("AES-NI is not supported on this platform");
+}
+
+#endif // MINE_X86
+
+void AES::encryptBlock(const byte* input, byte* output, const RoundKeys* roundKeys)
+{
+    switch (roundKeys->backend) {
+    case Backend::AesNi:
+        encryptBlockAesNi(input, output, roundKeys);
+        break;
+    case Backend::TTable:
+        encryptBlockTTable(input, output, roundKeys);
+        break;
+    default:
+        State state;
+        std::memcpy(state.data(), input, kBlockSize);
+        encryptState(&state, &roundKeys->schedule, roundKeys->rounds);
+        std::memcpy(output, state.data(), kBlockSize);
+        break;
+    }
+}
+
+void AES::decryptBlock(const byte* input, byte* output, const RoundKeys* roundKeys)
+{
+    switch (roundKeys->backend) {
+    case Backend::AesNi: {
+        const byte zero[kBlockSize] = {};
+        decryptBlocksAesNi(input, 1, zero, output, roundKeys);
+        break;
+    }
+    case Backend::TTable:
+        decryptBlockTTable(input, output, roundKeys);
+        break;
+    default:
+        State state;
+        std::memcpy(state.data(), input, kBlockSize);
+        decryptState(&state, &roundKeys->schedule, roundKeys->rounds);
+        std::memcpy(output, state.data(), kBlockSize);
+        break;
+    }
+}
+
+void AES::decryptBlocks(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys)
+{
+    if (roundKeys->backend == Backend::AesNi) {
+        decryptBlocksAesNi(input, nBlocks, prev, output, roundKeys);
+        return;
+    }
+    for (std::size_t i = 0; i < nBlocks; ++i) {
+        decryptBlock(input, output, roundKeys);
+        for (std::size_t j = 0; j < kBlockSize; ++j) {
+            output[j] ^= prev[j];
+        }
+        prev = input;
+        input += kBlockSize;
+        output += kBlockSize;
+    }
+}
+
+///
+/// Threads are started once and wait for segments, so that deciphering a small
+/// piece (e.g, chunk of stream) does not pay for starting threads every time
+///
+class AES::Workers {
+public:
+    explicit Workers(std::size_t count) :
+        m_stopping(false)
+    {
+        for (std::size_t i = 0; i < count; ++i) {
+            m_threads.emplace_back(&Workers::work, this);
+        }
+    }
+
+    ~Workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_queued.notify_all();
+        for (std::thread& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    Workers(const Workers&) = delete;
+    Workers& operator=(const Workers&) = delete;
+
+    inline std::size_t size() const { return m_threads.size(); }
+
+    ///
+    /// \brief Runs task(0) on calling thread and task(1) to task(nTasks - 1) on workers,
+    /// returns once all of them are done. Task must not throw
+    ///
+    void run(std::size_t nTasks, const std::function<void(std::size_t)>& task)
+    {
+        std::size_t remaining = nTasks - 1;
+        std::condition_variable finished;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (std::size_t i = 1; i < nTasks; ++i) {
+                m_jobs.emplace_back([&, i]() {
+                    task(i);
+                    std::lock_guard<std::mutex> doneLock(m_mutex);
+                    if (--remaining == 0) {
+                        finished.notify_all();
+                    }
+                });
+            }
+        }
+        m_queued.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        finished.wait(lock, [&]() { return remaining == 0; });
+    }
+
+private:
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_queued;
+    bool m_stopping;
+
+    void work()
+    {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_queued.wait(lock, [&]() { return m_stopping || !m_jobs.empty(); });
+                if (m_jobs.empty()) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+///
+/// Each segment is deciphered using the last cipher block of the previous
+/// segment as its IV, first segment is deciphered on calling thread
+///
+void AES::decryptBlocksParallel(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys, Workers* workers)
+{
+    const std::size_t nSegments = workers == nullptr ? 1 : std::min(workers->size() + 1, nBlocks / kMinBlocksPerThread);
+    if (nSegments <= 1) {
+        decryptBlocks(input, nBlocks, prev, output, roundKeys);
+        return;
+    }
+
+    const std::size_t blocksPerSegment = nBlocks / nSegments;
+    std::vector<std::exception_ptr> errors(nSegments);
+    workers->run(nSegments, [&](std::size_t seg) {
+        const std::size_t first = seg * blocksPerSegment;
+        const std::size_t count = seg + 1 == nSegments ? nBlocks - first : blocksPerSegment;
+        try {
+            decryptBlocks(input + (first * kBlockSize), count,
+                          seg == 0 ? prev : input + ((first - 1) * kBlockSize),
+                          output + (first * kBlockSize), roundKeys);
+        } catch (...) {
+            errors[seg] = std::current_exception();
+        }
+    });
+
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+bool AES::isSupported(Backend backend)
+{
+    if (backend != Backend::AesNi) {
+        return true;
+    }
+#if MINE_X86
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) && (edx & bit_SSE2);
+#else
+    return false;
+#endif
+}
+
+///
+/// Each candidate has to produce exactly what Backend::Reference does
+/// with FIPS.197 Appendix C keys (ECB and CBC) before it is used
+///
+AES::Backend AES::detectBackend()
+{
+    // key 000102...1f and plain blocks 00112233...ff, ff...33221100 twice
+    Key fullKey(32);
+    ByteArray plain(4 * kBlockSize);
+    for (std::size_t i = 0; i < fullKey.size(); ++i) {
+        fullKey[i] = static_cast<byte>(i);
+    }
+    for (std::size_t i = 0; i < plain.size(); ++i) {
+        const byte b = static_cast<byte>((i % kBlockSize) * 0x11);
+        plain[i] = (i / kBlockSize) % 2 == 0 ? b : static_cast<byte>(0xff - b);
+    }
+    const Backend candidates[] = { Backend::AesNi, Backend::TTable };
+    for (Backend candidate : candidates) {
+        if (!isSupported(candidate)) {
+            continue;
+        }
+        bool verified = true;
+        for (std::size_t keySize : { 16, 24, 32 }) {
+            const Key key(fullKey.begin(), fullKey.begin() + keySize);
+            const KeySchedule keySchedule = keyExpansion(&key);
+            const RoundKeys reference = prepareRoundKeys(keySchedule, keySize, Backend::Reference);
+            const RoundKeys roundKeys = prepareRoundKeys(keySchedule, keySize, candidate);
+
+            const std::size_t nBlocks = plain.size() / kBlockSize;
+            ByteArray expected(plain.size()), actual(plain.size());
+            ByteArray expectedPlain(plain.size()), actualPlain(plain.size());
+            for (std::size_t i = 0; i < nBlocks; ++i) {
+                encryptBlock(plain.data() + (i * kBlockSize), expected.data() + (i * kBlockSize), &reference);
+                encryptBlock(plain.data() + (i * kBlockSize), actual.data() + (i * kBlockSize), &roundKeys);
+            }
+            decryptBlocks(expected.data() + kBlockSize, nBlocks - 1, expected.data(), expectedPlain.data(), &reference);
+            decryptBlocks(expected.data() + kBlockSize, nBlocks - 1, expected.data(), actualPlain.data(), &roundKeys);
+            if (actual != expected || actualPlain != expectedPlain) {
+                verified = false;
+                break;
+            }
+        }
+        if (verified) {
+            return candidate;
+        }
+    }
+    return Backend::Reference;
+}
+
+AES::Backend AES::bestBackend()
+{
+    static const Backend kBestBackend = detectBackend();
+    return kBestBackend;
+}
+
+void AES::setBackend(Backend backend)
+{
+    if (!isSupported(backend)) {
+        throw std::invalid_argument("AES backend is not supported on this CPU");
+    }
+    m_backend = backend;
+    if (!m_key.empty()) {
+        m_roundKeys = prepareRoundKeys(m_keySchedule, m_key.size(), m_backend);
+    }
 }
 
 ByteArray AES::resolveInputMode(const std::string& input, MineCommon::Encoding inputMode)
 {
     if (inputMode == MineCommon::Encoding::Raw) {
-        return Base16::fromString(Base16::encode(input));
+        return ByteArray(input.begin(), input.end());
     } else if (inputMode == MineCommon::Encoding::Base16) {
         return Base16::fromString(input);
     }
     // base64
-    return Base16::fromString(Base16::encode(Base64::decode(input)));
+    const std::string decoded = Base64::decode(input);
+    return ByteArray(decoded.begin(), decoded.end());
 }
 
 std::string AES::resolveOutputMode(const ByteArray& input, MineCommon::Encoding outputMode)
@@ -777,12 +1535,16 @@ std::string AES::resolveOutputMode(const ByteArray& input, MineCommon::Encoding
 
 std::size_t AES::getPaddingIndex(const ByteArray& byteArr)
 {
-    char lastChar = byteArr[kBlockSize - 1];
-    int c = lastChar & 0xff;
+    return getPaddingIndex(byteArr.data());
+}
+
+std::size_t AES::getPaddingIndex(const byte* block)
+{
+    int c = block[kBlockSize - 1] & 0xff;
     if (c > 0 && c <= kBlockSize) {
         bool validPadding = true;
         for (int chkIdx = kBlockSize - c; chkIdx < kBlockSize; ++chkIdx) {
-            if ((byteArr[chkIdx] & 0xff) != c) {
+            if ((block[chkIdx] & 0xff) != c) {
                 // with openssl we found padding
                 validPadding = false;
                 break;
@@ -797,11 +1559,15 @@ std::size_t AES::getPaddingIndex(const ByteArray& byteArr)
     return kBlockSize;
 }
 
-// public
-
-ByteArray AES::encrypt(const ByteArray& input, const Key* key, bool pkcs5Padding)
+void AES::padBlock(const byte* input, std::size_t len, byte* block, bool pkcs5Padding)
 {
+    std::copy_n(input, len, block);
+    // PKCS#5 padding, otherwise zero-padding
+    std::fill(block + len, block + kBlockSize, pkcs5Padding ? kBlockSize - (len % kBlockSize) : 0);
+}
 
+void AES::useKey(const Key* key)
+{
     std::size_t keySize = key->size();
 
     // key size validation
@@ -809,184 +1575,151 @@ ByteArray AES::encrypt(const ByteArray& input, const Key* key, bool pkcs5Padding
         throw std::invalid_argument("Invalid AES key size");
     }
 
-    const std::size_t inputSize = input.size();
-
     if (*key != m_key) {
         m_keySchedule = keyExpansion(key);
         m_key = *key;
+        m_roundKeys = prepareRoundKeys(m_keySchedule, keySize, m_backend);
     }
+}
 
-    ByteArray result;
-
-    for (std::size_t i = 0; i < inputSize; i += kBlockSize) {
-        ByteArray inputBlock(kBlockSize, 0);
+// public
 
-        std::size_t j = 0;
-        // don't use copy_n as we are setting the values
-        for (; j < kBlockSize && inputSize > j + i; ++j) {
-            inputBlock[j] = input[j + i];
-        }
+std::size_t AES::encryptInto(const byte* input, std::size_t len, byte* output, const Key* key, bool pkcs5Padding)
+{
+    useKey(key);
 
-        if (pkcs5Padding && j != kBlockSize) {
-            // PKCS#5 padding
-            std::fill(inputBlock.begin() + j, inputBlock.end(), kBlockSize - (j % kBlockSize));
+    for (std::size_t i = 0; i < len; i += kBlockSize) {
+        if (len - i >= kBlockSize) {
+            encryptBlock(input + i, output + i, &m_roundKeys);
+        } else {
+            std::array<byte, kBlockSize> block;
+            padBlock(input + i, len - i, block.data(), pkcs5Padding);
+            encryptBlock(block.data(), output + i, &m_roundKeys);
         }
-
-        ByteArray outputBlock = encryptSingleBlock(inputBlock.begin() + i, key, &m_keySchedule);
-        std::copy(outputBlock.begin(), outputBlock.end(), std::back_inserter(result));
     }
-    return result;
+    return cipherSize(len);
 }
 
-ByteArray AES::decrypt(const ByteArray& input, const Key* key)
+std::size_t AES::decryptInto(const byte* input, std::size_t len, byte* output, const Key* key)
 {
-
-    std::size_t keySize = key->size();
-
-    // key size validation
-    if (keySize != 16 && keySize != 24 && keySize != 32) {
-        throw std::invalid_argument("Invalid AES key size");
-    }
-
-    if (*key != m_key) {
-        m_keySchedule = keyExpansion(key);
-        m_key = *key;
-    }
-
-    const std::size_t inputSize = input.size();
-    ByteArray result;
-
-    for (std::size_t i = 0; i < inputSize; i += kBlockSize) {
-        ByteArray inputBlock(kBlockSize, 0);
-
-        std::size_t j = 0;
-        // don't use copy_n here as we are setting the values
-        for (; j < kBlockSize && inputSize > j + i; ++j) {
-            inputBlock[j] = input[j + i];
-        }
-        ByteArray outputBlock = decryptSingleBlock(inputBlock.begin(), key, &m_keySchedule);
-
-        if (i + kBlockSize == inputSize) {
-            // check padding
-            j = getPaddingIndex(outputBlock);
+    useKey(key);
+
+    std::size_t written = 0;
+    for (std::size_t i = 0; i < len; i += kBlockSize) {
+        if (len - i >= kBlockSize) {
+            decryptBlock(input + i, output + i, &m_roundKeys);
+            // check padding on last block
+            written = i + (i + kBlockSize == len ? getPaddingIndex(output + i) : kBlockSize);
+        } else {
+            // incomplete block is zero-padded and only its length is kept
+            std::array<byte, kBlockSize> block;
+            padBlock(input + i, len - i, block.data(), false);
+            decryptBlock(block.data(), block.data(), &m_roundKeys);
+            std::copy_n(block.begin(), len - i, output + i);
+            written = len;
         }
-        std::copy_n(outputBlock.begin(), j, std::back_inserter(result));
     }
-    return result;
+    return written;
 }
 
-ByteArray AES::encrypt(const ByteArray& input, const Key* key, ByteArray& iv, bool pkcs5Padding)
+std::size_t AES::encryptInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv, bool pkcs5Padding)
 {
-
-    std::size_t keySize = key->size();
-
-    // key size validation
-    if (keySize != 16 && keySize != 24 && keySize != 32) {
-        throw std::invalid_argument("Invalid AES key size");
-    }
-
-    if (!iv.empty() && iv.size() != 16) {
+    if (iv.size() != kBlockSize) {
         throw std::invalid_argument("Invalid IV, it should be same as block size");
-    } else if (iv.empty()) {
-        // generate IV
-        iv = MineCommon::generateRandomBytes(16);
     }
 
-    if (*key != m_key) {
-        m_keySchedule = keyExpansion(key);
-        m_key = *key;
-    }
-
-    const std::size_t inputSize = input.size();
-
-    ByteArray result;
-    ByteArray::const_iterator nextXorWithBeg = iv.begin();
-    ByteArray::const_iterator nextXorWithEnd = iv.end();
+    useKey(key);
 
 #if MINE_PROFILING
     auto started = std::chrono::steady_clock::now();
 #endif
-    for (std::size_t i = 0; i < inputSize; i += kBlockSize) {
-        ByteArray inputBlock(kBlockSize, 0);
-
-        std::size_t j = 0;
-        // don't use copy_n as we are setting the values
-        for (; j < kBlockSize && inputSize > j + i; ++j) {
-            inputBlock[j] = input[j + i];
-        }
-        if (pkcs5Padding && j != kBlockSize) {
-            // PKCS#5 padding
-            std::fill(inputBlock.begin() + j, inputBlock.end(), kBlockSize - (j % kBlockSize));
+    const byte* prev = iv.data();
+    std::array<byte, kBlockSize> block;
+    for (std::size_t i = 0; i < len; i += kBlockSize) {
+        padBlock(input + i, std::min<std::size_t>(kBlockSize, len - i), block.data(), pkcs5Padding);
+        for (std::size_t j = 0; j < kBlockSize; ++j) {
+            block[j] ^= prev[j];
         }
-        xorWithRange(&inputBlock, nextXorWithBeg, nextXorWithEnd);
-
-        ByteArray outputBlock = encryptSingleBlock(inputBlock.begin(), key, &m_keySchedule);
-        std::copy(outputBlock.begin(), outputBlock.end(), std::back_inserter(result));
-        nextXorWithBeg = result.end() - kBlockSize;
-        nextXorWithEnd = result.end();
+        encryptBlock(block.data(), output + i, &m_roundKeys);
+        prev = output + i;
     }
 #if MINE_PROFILING
     endProfiling(started, "block encryption");
 #endif
 
-    return result;
+    return cipherSize(len);
 }
 
-ByteArray AES::decrypt(const ByteArray& input, const Key* key, ByteArray& iv)
+std::size_t AES::decryptInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv)
 {
-
-    std::size_t keySize = key->size();
-
-    // key size validation
-    if (keySize != 16 && keySize != 24 && keySize != 32) {
-        throw std::invalid_argument("Invalid AES key size");
+    if (decryptRawInto(input, len, output, key, iv) == 0) {
+        return 0;
     }
 
-    const std::size_t inputSize = input.size();
+    // check padding
+    return len - kBlockSize + getPaddingIndex(output + len - kBlockSize);
+}
+
+std::size_t AES::decryptRawInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv)
+{
+    useKey(key);
 
-    if (inputSize % kBlockSize != 0) {
+    if (len % kBlockSize != 0) {
         throw std::invalid_argument("Ciphertext length is not a multiple of block size");
     }
 
-    if (*key != m_key) {
-        m_keySchedule = keyExpansion(key);
-        m_key = *key;
+    if (iv.size() != kBlockSize) {
+        throw std::invalid_argument("Invalid IV, it should be same as block size");
     }
 
-    ByteArray result;
-
-    ByteArray::const_iterator nextXorWithBeg = iv.begin();
-    ByteArray::const_iterator nextXorWithEnd = iv.end();
+    if (len == 0) {
+        return 0;
+    }
 
 #if MINE_PROFILING
     auto started = std::chrono::steady_clock::now();
 #endif
-    for (std::size_t i = 0; i < inputSize; i += kBlockSize) {
-        ByteArray inputBlock(kBlockSize, 0);
+    const auto profilingStarted = profilingNow();
+    decryptBlocksParallel(input, len / kBlockSize, iv.data(), output, &m_roundKeys, m_workers.get());
+    endRuntimeProfiling("block decryption", profilingStarted, len);
+#if MINE_PROFILING
+    endProfiling(started, "block decryption");
+#endif
+    return len;
+}
 
-        std::size_t j = 0;
-        // don't use copy_n as we are setting the values
-        for (; j < kBlockSize && inputSize > j + i; ++j) {
-            inputBlock[j] = input[j + i];
-        }
+ByteArray AES::encrypt(const ByteArray& input, const Key* key, bool pkcs5Padding)
+{
+    ByteArray result(cipherSize(input.size()));
+    encryptInto(input.data(), input.size(), result.data(), key, pkcs5Padding);
+    return result;
+}
 
-        ByteArray outputBlock = decryptSingleBlock(inputBlock.begin(), key, &m_keySchedule);
+ByteArray AES::decrypt(const ByteArray& input, const Key* key)
+{
+    ByteArray result(input.size());
+    result.resize(decryptInto(input.data(), input.size(), result.data(), key));
+    return result;
+}
 
-        xorWithRange(&outputBlock, nextXorWithBeg, nextXorWithEnd);
+ByteArray AES::encrypt(const ByteArray& input, const Key* key, ByteArray& iv, bool pkcs5Padding)
+{
+    if (!iv.empty() && iv.size() != 16) {
+        throw std::invalid_argument("Invalid IV, it should be same as block size");
+    } else if (iv.empty()) {
+        // generate IV
+        iv = MineCommon::generateRandomBytes(16);
+    }
 
-        if (i + kBlockSize == inputSize) {
-            // check padding
-            j = getPaddingIndex(outputBlock);
-        } else {
-            nextXorWithBeg = input.begin() + i;
-            nextXorWithEnd = input.begin() + i + kBlockSize;
-        }
+    ByteArray result(cipherSize(input.size()));
+    encryptInto(input.data(), input.size(), result.data(), key, iv, pkcs5Padding);
+    return result;
+}
 
-        std::copy_n(outputBlock.begin(), j, std::back_inserter(result));
-    }
-#if MINE_PROFILING
-    endProfiling(started, "block decryption");
-#endif
+ByteArray AES::decrypt(const ByteArray& input, const Key* key, ByteArray& iv)
+{
+    ByteArray result(input.size());
+    result.resize(decryptInto(input.data(), input.size(), result.data(), key, iv));
     return result;
 }
 
@@ -1118,6 +1851,195 @@ ByteArray AES::decr(const ByteArray& input, ByteArray& iv)
     return decrypt(input, &m_key, iv);
 }
 
+std::size_t AES::decr(std::istream& input, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, std::size_t chunkSize)
+{
+    if (m_key.empty()) {
+        throw std::runtime_error("Key not set");
+    }
+    return decrypt(input, &m_key, iv, sink, inputEncoding, chunkSize);
+}
+
+std::size_t AES::decr(const char* input, std::size_t len, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, std::size_t chunkSize)
+{
+    if (m_key.empty()) {
+        throw std::runtime_error("Key not set");
+    }
+    return decrypt(input, len, &m_key, iv, sink, inputEncoding, chunkSize);
+}
+
+// streaming
+
+std::size_t AES::decrypt(std::istream& input, const Key* key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, std::size_t chunkSize)
+{
+    if (chunkSize == 0) {
+        chunkSize = kStreamChunkSize;
+    }
+    StreamDecryptor decryptor(*key, iv, sink, inputEncoding, m_workers, m_backend);
+    std::vector<char> buffer(chunkSize);
+    while (input) {
+        const auto started = profilingNow();
+        input.read(buffer.data(), chunkSize);
+        const std::streamsize nRead = input.gcount();
+        endRuntimeProfiling("stream read", started, static_cast<std::size_t>(std::max<std::streamsize>(nRead, 0)));
+        if (nRead <= 0) {
+            break;
+        }
+        decryptor.update(buffer.data(), static_cast<std::size_t>(nRead));
+    }
+    if (input.bad()) {
+        throw std::runtime_error("Unable to read cipher from stream");
+    }
+    return decryptor.finalize();
+}
+
+std::size_t AES::decrypt(const char* input, std::size_t len, const Key* key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, std::size_t chunkSize)
+{
+    if (chunkSize == 0) {
+        chunkSize = kStreamChunkSize;
+    }
+    StreamDecryptor decryptor(*key, iv, sink, inputEncoding, m_workers, m_backend);
+    for (std::size_t i = 0; i < len; i += chunkSize) {
+        decryptor.update(input + i, std::min(chunkSize, len - i));
+    }
+    return decryptor.finalize();
+}
+
+AES::StreamDecryptor::StreamDecryptor(const Key& key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, std::size_t threadCount, Backend backend) :
+    StreamDecryptor(key, iv, sink, inputEncoding, threadCount > 1 ? std::make_shared<Workers>(threadCount - 1) : nullptr, backend)
+{
+}
+
+AES::StreamDecryptor::StreamDecryptor(const Key& key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, const std::shared_ptr<Workers>& workers, Backend backend) :
+    m_roundKeys(prepareRoundKeys(keyExpansion(&key), key.size(), backend)),
+    m_sink(sink),
+    m_inputEncoding(inputEncoding),
+    m_prev(iv),
+    m_total(0),
+    m_workers(workers),
+    m_finalized(false)
+{
+    if (iv.size() != kBlockSize) {
+        throw std::invalid_argument("Invalid IV, it should be same as block size");
+    }
+    if (!isSupported(backend)) {
+        throw std::invalid_argument("AES backend is not supported on this CPU");
+    }
+}
+
+void AES::StreamDecryptor::update(const char* data, std::size_t len)
+{
+    if (m_finalized) {
+        throw std::runtime_error("Stream already finalized");
+    }
+    const auto started = profilingNow();
+    decode(data, len);
+    if (m_inputEncoding != MineCommon::Encoding::Raw) {
+        endRuntimeProfiling(m_inputEncoding == MineCommon::Encoding::Base64 ? "base64 decode" : "base16 decode", started, len);
+    }
+    decryptAvailable(false);
+}
+
+std::size_t AES::StreamDecryptor::finalize()
+{
+    if (m_finalized) {
+        return m_total;
+    }
+    if (!m_pending.empty()) {
+        throw std::invalid_argument("Incomplete cipher encoding");
+    }
+    if (m_cipher.size() % kBlockSize != 0) {
+        throw std::invalid_argument("Ciphertext length is not a multiple of block size");
+    }
+    decryptAvailable(true);
+    m_finalized = true;
+    return m_total;
+}
+
+///
+/// Decodes the input to m_cipher. Only full units (quad for base64,
+/// pair for base16) are decoded, the rest waits in m_pending for the
+/// next piece of input
+///
+void AES::StreamDecryptor::decode(const char* data, std::size_t len)
+{
+    if (m_inputEncoding == MineCommon::Encoding::Raw) {
+        m_cipher.insert(m_cipher.end(), data, data + len);
+        return;
+    }
+    if (m_inputEncoding == MineCommon::Encoding::Base64) {
+        std::size_t offset = 0;
+        if (!m_pending.empty()) {
+            // complete the quad left from previous piece
+            for (; offset < len && m_pending.size() < 4; ++offset) {
+                if (!std::isspace(static_cast<unsigned char>(data[offset]))) {
+                    m_pending.push_back(data[offset]);
+                }
+            }
+            if (m_pending.size() < 4) {
+                return;
+            }
+            byte decoded[3];
+            const std::size_t n = Base64::decode(m_pending.data(), m_pending.size(), decoded);
+            m_cipher.insert(m_cipher.end(), decoded, decoded + n);
+            m_pending.clear();
+        }
+        const std::size_t start = m_cipher.size();
+        std::size_t consumed = 0;
+        m_cipher.resize(start + Base64::maxDecodedLength(len - offset));
+        m_cipher.resize(start + Base64::decode(data + offset, len - offset, m_cipher.data() + start, &consumed));
+        for (std::size_t i = offset + consumed; i < len; ++i) {
+            if (!std::isspace(static_cast<unsigned char>(data[i]))) {
+                m_pending.push_back(data[i]);
+            }
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < len; ++i) {
+        if (!std::isspace(static_cast<unsigned char>(data[i]))) {
+            m_pending.push_back(data[i]);
+        }
+    }
+    const std::size_t decodable = m_pending.size() - (m_pending.size() % 2);
+    if (decodable == 0) {
+        return;
+    }
+    const std::string decoded = Base16::decode(m_pending.substr(0, decodable));
+    m_cipher.insert(m_cipher.end(), decoded.begin(), decoded.end());
+    m_pending.erase(0, decodable);
+}
+
+///
+/// Decrypts all the full blocks available except for the last one
+/// which may be the padded block, unless this is the last call
+///
+void AES::StreamDecryptor::decryptAvailable(bool last)
+{
+    std::size_t nBlocks = m_cipher.size() / kBlockSize;
+    if (!last && nBlocks > 0) {
+        --nBlocks; // hold back, it may be the last block
+    }
+    if (nBlocks == 0) {
+        return;
+    }
+    m_plain.resize(nBlocks * kBlockSize);
+    const auto started = profilingNow();
+    decryptBlocksParallel(m_cipher.data(), nBlocks, m_prev.data(), m_plain.data(), &m_roundKeys, m_workers.get());
+    endRuntimeProfiling("block decryption", started, nBlocks * kBlockSize);
+    std::copy_n(m_cipher.begin() + ((nBlocks - 1) * kBlockSize), kBlockSize, m_prev.begin());
+
+    std::size_t plainSize = m_plain.size();
+    if (last) {
+        // check padding
+        const ByteArray lastBlock(m_plain.end() - kBlockSize, m_plain.end());
+        plainSize = plainSize - kBlockSize + getPaddingIndex(lastBlock);
+    }
+    m_cipher.erase(m_cipher.begin(), m_cipher.begin() + (nBlocks * kBlockSize));
+    if (plainSize > 0) {
+        m_total += plainSize;
+        m_sink(m_plain.data(), plainSize);
+    }
+}
+
 
 
 bool ZLib::compressFile(const std::string& gzFilename, const std::string& inputFile)
@@ -24,6 +24,10 @@
 #include <map>
 #include <cmath>
 #include <stdexcept>
+#include <functional>
+#include <istream>
+#include <chrono>
+#include <memory>
 
 namespace mine {
 
@@ -266,11 +270,20 @@ public:
 
     static const std::unordered_map<byte, byte> kDecodeMap;
 
+    ///
+    /// \brief Same as kDecodeMap for every byte, whitespace maps to kWhitespace
+    /// and anything else that is not valid maps to kInvalid
+    ///
+    static const byte kDecodeTable[256];
+
     ///
     /// \brief Padding is must in mine implementation of base64
     ///
     static const int kPadding = 64;
 
+    static const byte kWhitespace = 0x80;
+    static const byte kInvalid = 0xff;
+
     ///
     /// \brief Encodes input of length to base64 encoding
     ///
@@ -332,124 +345,50 @@ public:
 
     ///
     /// \brief Decodes encoded base64
-    /// \see decode(const Iter&, const Iter&)
+    /// \see decode(const char*, std::size_t, byte*, std::size_t*)
     ///
     static std::string decode(const std::string& e)
     {
         // don't check for e's length to be multiple of 4
         // because of 76 character line-break format (MIME)
         // https://tools.ietf.org/html/rfc4648#section-3.1
-        return decode(e.begin(), e.end());
+        std::string result(maxDecodedLength(e.size()), '\0');
+        result.resize(decode(e.data(), e.size(), reinterpret_cast<byte*>(&result[0])));
+        return result;
     }
 
     ///
     /// \brief Decodes base64 iterator from begin to end
-    /// \throws std::invalid_argument if invalid encoding. Another time it is thrown
-    /// is if no padding is found
-    /// std::invalid_argument::what() is set according to the error
+    /// \see decode(const std::string&)
     ///
     template <class Iter>
     static std::string decode(const Iter& begin, const Iter& end)
     {
-        //
-        // we use example following example for implementation basis
-        // Bits              01100001   01100010  01100011
-        // 24-bit stream:    011000   010110   001001   100011
-        // result indices     24        22       9        35
-        //
-
-        auto findPosOf = [](char c) -> int {
-            try {
-                return kDecodeMap.at(static_cast<int>(c & 0xff));
-            } catch (const std::exception& e) {
-                throw e;
-            }
-        };
-
-        std::stringstream ss;
-        for (auto it = begin; it < end; it += 4) {
-            try {
-                while (iswspace(*it)) {
-                    ++it;
-
-                    if (it >= end) {
-                        goto result;
-                    }
-                }
-                int b0 = findPosOf(*it);
-                if (b0 == kPadding) {
-                    throw std::invalid_argument("No data available");
-                }
-                if (b0 == -1) {
-                    throw std::invalid_argument("Invalid base64 encoding");
-                }
-
-                while (iswspace(*(it + 1))) {
-                    ++it;
-
-                    if (it >= end) {
-                        goto result;
-                    }
-                }
-                int b1 = findPosOf(*(it + 1));
-                if (b1 == -1) {
-                    throw std::invalid_argument("Invalid base64 encoding");
-                }
-
-                while (iswspace(*(it + 2))) {
-                    ++it;
-
-                    if (it >= end) {
-                        goto result;
-                    }
-                }
-                int b2 = findPosOf(*(it + 2));
-                if (b2 == -1) {
-                    throw std::invalid_argument("Invalid base64 encoding");
-                }
-
-                while (iswspace(*(it + 3))) {
-                    ++it;
+        return decode(std::string(begin, end));
+    }
 
-                    if (it >= end) {
-                        goto result;
-                    }
-                }
-                int b3 = findPosOf(*(it + 3));
-                if (b3 == -1) {
-                    throw std::invalid_argument("Invalid base64 encoding");
-                }
+    ///
+    /// \brief Decodes base64 to the buffer, whitespace anywhere in the input is ignored
+    /// \param data Encoded input
+    /// \param len Length of input
+    /// \param output Buffer of at least maxDecodedLength(len) bytes
+    /// \param consumed If not null, incomplete quad at the end of input is not an error
+    /// instead it is left out and this is set to the number of input bytes decoded
+    /// \return Number of bytes written to output
+    /// \throws std::invalid_argument if invalid encoding. Another time it is thrown
+    /// is if no padding is found
+    /// std::invalid_argument::what() is set according to the error
+    ///
+    static std::size_t decode(const char* data, std::size_t len, byte* output, std::size_t* consumed = nullptr);
 
-                ss << static_cast<byte>(b0 << 2 |     // 011000 << 2 ==> 01100000
-                                        b1 >> 4); // 000001 >> 4 ==> 01100001 ==> 11000001 = 97
-
-                if (b1 != kPadding) {
-                    if (b2 == kPadding) {
-                        // second bitset is only 4 bits
-                    } else {
-                        ss << static_cast<byte>((b1 & ~(1 << 5) & ~(1 << 4)) << 4 |     // 010110 ==> 000110 << 4 ==> 1100000
-                                                                                        // first we clear the bits at pos 4 and 5
-                                                                                        // then we concat with next bit
-                                                 b2 >> 2); // 001001 >> 2 ==> 00000010 ==> 01100010 = 98
-                        if (b3 == kPadding) {
-                            // third bitset is only 4 bits
-                        } else {
-                            ss << static_cast<byte>((b2 & ~(1 << 5) & ~(1 << 4) & ~(1 << 3) & ~(1 << 2)) << 6 |     // 001001 ==> 000001 << 6 ==> 01000000
-                                                    // first we clear first 4 bits
-                                                    // then concat with last byte as is
-                                                     b3); // as is
-                        }
-                    }
-                }
-            } catch (const std::exception& e) {
-                throw std::invalid_argument(std::string("Invalid base64 encoding: " + std::string(e.what())));
-            }
-        }
-result:
-        return ss.str();
+    ///
+    /// \brief Maximum length of decoded data for encoded input of length n
+    ///
+    inline static std::size_t maxDecodedLength(std::size_t n) noexcept
+    {
+        return ((n + 3) / 4) * 3;
     }
 
-
 #ifdef MINE_WSTRING_CONVERSION
     ///
     /// \brief Converts wstring to corresponding string and returns
@@ -530,6 +469,23 @@ public:
     ///
     using Key = ByteArray;
 
+    ///
+    /// \brief Receives plain bytes as they are produced by streaming decryption.
+    /// The data is only valid for the duration of the call
+    ///
+    using ByteSink = std::function<void(const byte* data, std::size_t len)>;
+
+    ///
+    /// \brief Default number of input bytes processed at a time by streaming functions
+    ///
+    static const std::size_t kStreamChunkSize = 65536;
+
+    ///
+    /// \brief Incremental CBC-mode decryption
+    /// \see AES::StreamDecryptor
+    ///
+    class StreamDecryptor;
+
     AES() = default;
     AES(const std::string& key);
     AES(const ByteArray& key);
@@ -541,6 +497,71 @@ public:
     void setKey(const std::string& key);
     void setKey(const ByteArray& key);
 
+    ///
+    /// \brief Sets number of threads used for CBC-mode decryption.
+    /// Blocks in CBC-mode only depend on their own cipher and the previous
+    /// cipher block, so the input is split in to as many segments and
+    /// each segment is deciphered on its own thread. Worker threads are started
+    /// here and kept until the object (and all its copies) are destroyed
+    /// \param threadCount Number of threads, 0 to use all the hardware threads. Defaults to 1
+    ///
+    void setThreadCount(std::size_t threadCount);
+
+    inline std::size_t threadCount() const { return m_threadCount; }
+
+    ///
+    /// \brief Receives time spent in a phase of decryption and number of bytes it processed.
+    /// Phases are "stream read", "base64 decode", "base16 decode" and "block decryption"
+    ///
+    using Profiler = std::function<void(const char* phase, std::chrono::steady_clock::time_point started, std::chrono::steady_clock::time_point ended, std::size_t bytes)>;
+
+    ///
+    /// \brief Sets profiler for all the AES objects at runtime, nullptr (default) to disable.
+    /// Unlike MINE_PROFILING this needs no rebuild. It must be set before decryption starts
+    /// and it is called from whichever thread is decrypting
+    ///
+    static void setProfiler(const Profiler& profiler);
+
+    ///
+    /// \brief Implementation of the block cipher
+    ///
+    enum class Backend {
+        ///
+        /// \brief Byte-wise implementation following FIPS.197 step by step
+        ///
+        Reference,
+
+        ///
+        /// \brief 32-bit lookup tables combining SubBytes, ShiftRows and MixColumns (portable)
+        ///
+        TTable,
+
+        ///
+        /// \brief AES-NI instructions (x86 CPUs supporting them only)
+        ///
+        AesNi
+    };
+
+    ///
+    /// \brief Fastest backend supported by this CPU. It is detected once and
+    /// verified against Backend::Reference, if the verification fails the
+    /// next fastest backend is used
+    ///
+    static Backend bestBackend();
+
+    ///
+    /// \brief Returns true if backend can be used on this CPU
+    ///
+    static bool isSupported(Backend backend);
+
+    ///
+    /// \brief Sets the backend used by this object, defaults to bestBackend()
+    /// \throws std::invalid_argument if backend is not supported by this CPU
+    ///
+    void setBackend(Backend backend);
+
+    inline Backend backend() const { return m_backend; }
+
     ///
     /// \brief Generates random key of valid length
     ///
@@ -622,6 +643,89 @@ public:
     ///
     ByteArray decrypt(const ByteArray& input, const Key* key, ByteArray& iv);
 
+    ///
+    /// \brief Size of cipher produced by encryptInto() for input of len bytes
+    ///
+    static inline std::size_t cipherSize(std::size_t len)
+    {
+        return ((len + kBlockSize - 1) / kBlockSize) * kBlockSize;
+    }
+
+    ///
+    /// \brief Ciphers with ECB-Mode into caller's buffer without any allocation
+    /// \param input Plain input of any length
+    /// \param len Length of input in bytes
+    /// \param output Buffer of at least cipherSize(len) bytes, may be same as input
+    /// \param key Pointer to a valid AES key
+    /// \param pkcs5Padding Defaults to true, if false non-standard zero-padding is used
+    /// \return Number of bytes written to output
+    ///
+    std::size_t encryptInto(const byte* input, std::size_t len, byte* output, const Key* key, bool pkcs5Padding = true);
+
+    ///
+    /// \brief Deciphers with ECB-Mode into caller's buffer without any allocation
+    /// \param input Cipher of any length
+    /// \param len Length of input in bytes
+    /// \param output Buffer of at least len bytes, may be same as input
+    /// \param key Pointer to a valid AES key
+    /// \return Number of plain bytes written to output (padding excluded)
+    ///
+    std::size_t decryptInto(const byte* input, std::size_t len, byte* output, const Key* key);
+
+    ///
+    /// \brief Ciphers with CBC-Mode into caller's buffer without any allocation
+    /// \param input Plain input of any length
+    /// \param len Length of input in bytes
+    /// \param output Buffer of at least cipherSize(len) bytes, may be same as input
+    /// \param key Pointer to a valid AES key
+    /// \param iv Initialization vector
+    /// \param pkcs5Padding Defaults to true, if false non-standard zero-padding is used
+    /// \return Number of bytes written to output
+    ///
+    std::size_t encryptInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv, bool pkcs5Padding = true);
+
+    ///
+    /// \brief Deciphers with CBC-Mode into caller's buffer without any allocation
+    /// \param input Cipher, length must be multiple of block size
+    /// \param len Length of input in bytes
+    /// \param output Buffer of at least len bytes, must not overlap input
+    /// \param key Pointer to a valid AES key
+    /// \param iv Initialization vector
+    /// \return Number of plain bytes written to output (padding excluded)
+    ///
+    std::size_t decryptInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv);
+
+    ///
+    /// \brief Deciphers with CBC-Mode into caller's buffer like decryptInto() but keeps
+    /// the last block as it is, for callers that know the plain length and never padded it
+    /// \param input Cipher, length must be multiple of block size
+    /// \param len Length of input in bytes
+    /// \param output Buffer of at least len bytes, must not overlap input
+    /// \param key Pointer to a valid AES key
+    /// \param iv Initialization vector
+    /// \return Number of bytes written to output, i.e, len
+    ///
+    std::size_t decryptRawInto(const byte* input, std::size_t len, byte* output, const Key* key, const ByteArray& iv);
+
+    ///
+    /// \brief Deciphers stream with CBC-Mode in chunks, without ever holding whole input or result
+    /// \param input Stream of cipher positioned at the first byte of cipher
+    /// \param key Pointer to a valid AES key
+    /// \param iv Initialization vector
+    /// \param sink Function receiving plain bytes as they are decrypted
+    /// \param inputEncoding Encoding of the cipher in the stream
+    /// \param chunkSize Number of bytes read from stream at a time
+    /// \return Total number of plain bytes
+    /// \see StreamDecryptor
+    ///
+    std::size_t decrypt(std::istream& input, const Key* key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding = MineCommon::Encoding::Base64, std::size_t chunkSize = kStreamChunkSize);
+
+    ///
+    /// \brief Deciphers memory region (e.g, memory-mapped file) with CBC-Mode in chunks
+    /// \see decrypt(std::istream&, const Key*, const ByteArray&, const ByteSink&, MineCommon::Encoding, std::size_t)
+    ///
+    std::size_t decrypt(const char* input, std::size_t len, const Key* key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding = MineCommon::Encoding::Base64, std::size_t chunkSize = kStreamChunkSize);
+
 
     // cipher / decipher interface without keys
 
@@ -641,6 +745,10 @@ public:
 
     ByteArray decr(const ByteArray& input, ByteArray& iv);
 
+    std::size_t decr(std::istream& input, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding = MineCommon::Encoding::Base64, std::size_t chunkSize = kStreamChunkSize);
+
+    std::size_t decr(const char* input, std::size_t len, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding = MineCommon::Encoding::Base64, std::size_t chunkSize = kStreamChunkSize);
+
 private:
 
     ///
@@ -650,9 +758,10 @@ private:
 
     ///
     /// \brief KeySchedule is linear array of 4-byte words
+    /// (kNb * (Nr + 1) words are used, i.e, up to 60 for 256-bit key)
     /// \ref FIPS.197 Sec 5.2
     ///
-    using KeySchedule = std::map<uint8_t, Word>;
+    using KeySchedule = std::array<Word, 60>;
 
     ///
     /// \brief State as described in FIPS.197 Sec. 3.4
@@ -664,6 +773,16 @@ private:
     ///
     static const uint8_t kBlockSize = 16;
 
+    ///
+    /// \brief Minimum number of blocks worth spawning a thread for
+    ///
+    static const std::size_t kMinBlocksPerThread = 1024;
+
+    ///
+    /// \brief Persistent worker threads that segments of CBC-mode decryption run on
+    ///
+    class Workers;
+
     ///
     /// \brief Defines the key params to it's size
     ///
@@ -695,6 +814,47 @@ private:
     ///
     static const uint8_t kNb = 4;
 
+    ///
+    /// \brief Expanded key prepared for the backend in use
+    ///
+    struct RoundKeys {
+        Backend backend = Backend::Reference;
+
+        ///
+        /// \brief Nr
+        ///
+        uint8_t rounds = 0;
+
+        ///
+        /// \brief Key schedule as per FIPS.197, this is all
+        /// Backend::Reference and Backend::AesNi need for encryption
+        ///
+        KeySchedule schedule = {};
+
+        ///
+        /// \brief Big-endian words of schedule for Backend::TTable
+        ///
+        std::array<uint32_t, 60> encWords = {};
+
+        ///
+        /// \brief Round keys for equivalent inverse cipher (Sec. 5.3.5) in the order
+        /// they are used i.e, InvMixColumns applied to middle round keys,
+        /// as big-endian words for Backend::TTable and as bytes for Backend::AesNi
+        ///
+        std::array<uint32_t, 60> decWords = {};
+        alignas(16) std::array<byte, 240> decBytes = {};
+    };
+
+    ///
+    /// \brief Prepares round keys from key schedule for backend
+    ///
+    static RoundKeys prepareRoundKeys(const KeySchedule& keySchedule, std::size_t keySize, Backend backend);
+
+    ///
+    /// \brief Detects and verifies the fastest backend, see bestBackend()
+    ///
+    static Backend detectBackend();
+
 
     /// rotateWord function is specified in FIPS.197 Sec. 5.2:
     ///      The function RotWord() takes a
@@ -732,7 +892,7 @@ private:
     ///
     /// \brief Adds round to the state using specified key schedule
     ///
-    static void addRoundKey(State* state, KeySchedule* keySchedule, int round);
+    static void addRoundKey(State* state, const KeySchedule* keySchedule, int round);
 
     ///
     /// \brief Substitution step for state
@@ -824,7 +984,7 @@ private:
     /// \note This does not do any key or input validation
     /// \return 128-bit cipher text
     ///
-    static ByteArray encryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, KeySchedule* keySchedule);
+    static ByteArray encryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, const KeySchedule* keySchedule);
 
     ///
     /// \brief Raw decryption function - not for public use
@@ -835,7 +995,50 @@ private:
     /// \param key Byte array of key
     /// \return 128-bit plain text
     ///
-    static ByteArray decryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, KeySchedule* keySchedule);
+    static ByteArray decryptSingleBlock(const ByteArray::const_iterator& range, const Key* key, const KeySchedule* keySchedule);
+
+    ///
+    /// \brief Reference cipher on the state, used by encryptSingleBlock()
+    ///
+    static void encryptState(State* state, const KeySchedule* keySchedule, uint8_t totalRounds);
+
+    ///
+    /// \brief Reference inverse cipher on the state, used by decryptSingleBlock()
+    ///
+    static void decryptState(State* state, const KeySchedule* keySchedule, uint8_t totalRounds);
+
+    ///
+    /// \brief Ciphers single 128-bit block using the backend of round keys - not for public use
+    /// \note input and output may be the same
+    ///
+    static void encryptBlock(const byte* input, byte* output, const RoundKeys* roundKeys);
+
+    ///
+    /// \brief Deciphers single 128-bit block using the backend of round keys - not for public use
+    /// \note input and output may be the same
+    ///
+    static void decryptBlock(const byte* input, byte* output, const RoundKeys* roundKeys);
+
+    static void encryptBlockTTable(const byte* input, byte* output, const RoundKeys* roundKeys);
+    static void decryptBlockTTable(const byte* input, byte* output, const RoundKeys* roundKeys);
+    static void encryptBlockAesNi(const byte* input, byte* output, const RoundKeys* roundKeys);
+    static void decryptBlocksAesNi(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys);
+
+    ///
+    /// \brief Deciphers consecutive blocks with CBC-Mode - not for public use
+    /// \param input First cipher block
+    /// \param nBlocks Number of blocks to decipher
+    /// \param prev Block preceding the input (IV for very first block)
+    /// \param output Destination of nBlocks plain blocks (padding is not stripped), must not overlap input
+    ///
+    static void decryptBlocks(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys);
+
+    ///
+    /// \brief Splits the blocks in to segments and deciphers each segment on its own thread
+    /// \param workers Threads for all the segments but the first one, nullptr to decipher on calling thread only
+    /// \see decryptBlocks()
+    ///
+    static void decryptBlocksParallel(const byte* input, std::size_t nBlocks, const byte* prev, byte* output, const RoundKeys* roundKeys, Workers* workers);
 
     ///
     /// \brief Converts 4x4 byte state matrix in to linear 128-bit byte array
@@ -846,9 +1049,24 @@ private:
     /// \brief Get padding index for stripping the padding (unpadding)
     ///
     static std::size_t getPaddingIndex(const ByteArray& byteArr);
+    static std::size_t getPaddingIndex(const byte* block);
+
+    ///
+    /// \brief Copies last (incomplete) block of len bytes to block and pads the rest
+    ///
+    static void padBlock(const byte* input, std::size_t len, byte* block, bool pkcs5Padding);
+
+    ///
+    /// \brief Validates the key and expands it if it's different from current key
+    ///
+    void useKey(const Key* key);
 
     Key m_key; // to keep track of key differences
     KeySchedule m_keySchedule;
+    Backend m_backend = bestBackend();
+    RoundKeys m_roundKeys;
+    std::size_t m_threadCount = 1;
+    std::shared_ptr<Workers> m_workers; // shared by copies, nullptr for single thread
 
     // for tests
     friend class AESTest_RawCipher_Test;
@@ -868,6 +1086,66 @@ private:
     friend class AESTest_Copy_Test;
 };
 
+///
+/// \brief Incremental CBC-mode decryption
+///
+/// Input (encoded cipher) is fed in arbitrary sized pieces using update() and
+/// plain bytes are passed to the sink as soon as they are available. Apart from the
+/// undecoded remainder of the last piece, only the previous cipher block
+/// (CBC chaining) and the last plain block (held back for PKCS#5 unpadding
+/// in finalize()) are kept between the calls, so the memory used is bounded
+/// by the size of a single piece regardless of total input size.
+///
+class AES::StreamDecryptor {
+public:
+    ///
+    /// \param key Valid AES key
+    /// \param iv Initialization vector (16 bytes)
+    /// \param sink Function receiving plain bytes
+    /// \param inputEncoding Encoding of the cipher fed using update()
+    /// \param threadCount Number of threads each piece is deciphered with, worker threads
+    ///                    are kept until decryptor is destroyed
+    /// \param backend Block cipher implementation
+    /// \throws std::invalid_argument if key or IV is invalid
+    ///
+    StreamDecryptor(const Key& key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding = MineCommon::Encoding::Base64, std::size_t threadCount = 1, Backend backend = bestBackend());
+
+    ///
+    /// \brief Decrypts next piece of input. Whitespaces are ignored for base64 input
+    /// \throws std::invalid_argument if encoding is invalid
+    ///
+    void update(const char* data, std::size_t len);
+
+    ///
+    /// \brief Decrypts the last block and strips the padding
+    /// \throws std::invalid_argument if input is incomplete, std::runtime_error if padding is incorrect
+    /// \return Total number of plain bytes passed to the sink
+    ///
+    std::size_t finalize();
+
+private:
+    RoundKeys m_roundKeys;
+    ByteSink m_sink;
+    MineCommon::Encoding m_inputEncoding;
+    std::string m_pending; // encoded input that does not make up a full unit yet
+    ByteArray m_cipher; // cipher bytes not decrypted yet
+    ByteArray m_prev; // previous cipher block (or IV)
+    ByteArray m_plain;
+    std::size_t m_total;
+    std::shared_ptr<Workers> m_workers;
+    bool m_finalized;
+
+    ///
+    /// \brief Uses workers of AES object instead of starting its own
+    ///
+    StreamDecryptor(const Key& key, const ByteArray& iv, const ByteSink& sink, MineCommon::Encoding inputEncoding, const std::shared_ptr<Workers>& workers, Backend backend);
+
+    void decode(const char* data, std::size_t len);
+    void decryptAvailable(bool last);
+
+    friend class AES;
+};
+
 /// Here onwards start implementation for RSA - this contains
 /// generic classes (templates).
 /// User will provide their own implementation of big integer
@@ -0,0 +1,922 @@
+/**
+ * Photos of an archive and their decoded images, shared by the viewer
+ * and the benchmarks (this part does not need a window)
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef GALLERY_H
+#define GALLERY_H
+
+#include <vector>
+#include <list>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <csetjmp>
+
+#include <SFML/Graphics.hpp>
+
+#include <jpeglib.h>
+
+#include "metrics.h"
+
+/**
+ * Default memory budget for decoded images (--cache-mb)
+ */
+static const std::size_t kDefaultCacheMb = 512;
+
+/**
+ * Default number of photos decoded ahead of navigation (--prefetch)
+ */
+static const std::size_t kDefaultPrefetch = 3;
+
+/**
+ * Number of threads decoding photos ahead of navigation
+ */
+static const std::size_t kPrefetchThreads = 2;
+
+/**
+ * Size of thumbnail in pixels
+ */
+static const std::size_t kThumbnailSize = 128;
+
+/**
+ * Maximum number of thumbnails kept in memory
+ */
+static const std::size_t kMaximumCachedThumbnails = 1024;
+
+/**
+ * Pixels decoded around the area of JPEG region on each side
+ */
+static const unsigned kJpegCropMargin = 16;
+
+/**
+ * Returns size that fits in maxSize keeping the aspect ratio, size itself if it already fits
+ */
+inline sf::Vector2u fitSize(const sf::Vector2u& size, const sf::Vector2u& maxSize)
+{
+    if (size.x <= maxSize.x && size.y <= maxSize.y)
+    {
+        return size;
+    }
+    const double scale = std::min(static_cast<double>(maxSize.x) / size.x, static_cast<double>(maxSize.y) / size.y);
+    return sf::Vector2u(std::max(1u, static_cast<unsigned>(size.x * scale)), std::max(1u, static_cast<unsigned>(size.y * scale)));
+}
+
+/**
+ * Downscales area of image to width x height. Each pixel is average of the
+ * source pixels it covers (box filter) so that the detail is not lost the
+ * way it is with nearest neighbour sampling
+ */
+inline sf::Image downscale(const sf::Image& image, const sf::IntRect& area, unsigned width, unsigned height)
+{
+    sf::Image result;
+    if (area.width <= 0 || area.height <= 0 || width == 0 || height == 0)
+    {
+        return result;
+    }
+    const unsigned stride = image.getSize().x;
+    const unsigned areaWidth = static_cast<unsigned>(area.width);
+    const unsigned areaHeight = static_cast<unsigned>(area.height);
+    const sf::Uint8* pixels = image.getPixelsPtr();
+    std::vector<sf::Uint8> scaled(static_cast<std::size_t>(width) * height * 4);
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const unsigned y0 = static_cast<unsigned>(static_cast<std::uint64_t>(y) * areaHeight / height);
+        const unsigned y1 = std::max(y0 + 1, static_cast<unsigned>(static_cast<std::uint64_t>(y + 1) * areaHeight / height));
+        for (unsigned x = 0; x < width; ++x)
+        {
+            const unsigned x0 = static_cast<unsigned>(static_cast<std::uint64_t>(x) * areaWidth / width);
+            const unsigned x1 = std::max(x0 + 1, static_cast<unsigned>(static_cast<std::uint64_t>(x + 1) * areaWidth / width));
+            std::uint64_t sum[4] = { 0, 0, 0, 0 };
+            for (unsigned sy = y0; sy < y1; ++sy)
+            {
+                const sf::Uint8* row = pixels + ((static_cast<std::size_t>(area.top) + sy) * stride + area.left + x0) * 4;
+                for (unsigned sx = x0; sx < x1; ++sx, row += 4)
+                {
+                    sum[0] += row[0];
+                    sum[1] += row[1];
+                    sum[2] += row[2];
+                    sum[3] += row[3];
+                }
+            }
+            const std::uint64_t count = static_cast<std::uint64_t>(y1 - y0) * (x1 - x0);
+            sf::Uint8* out = &scaled[(static_cast<std::size_t>(y) * width + x) * 4];
+            for (int c = 0; c < 4; ++c)
+            {
+                out[c] = static_cast<sf::Uint8>((sum[c] + count / 2) / count);
+            }
+        }
+    }
+    result.create(width, height, scaled.data());
+    return result;
+}
+
+/**
+ * Downscales image to fit in size x size keeping the aspect ratio
+ */
+inline sf::Image createThumbnail(const sf::Image& image, unsigned size)
+{
+    const sf::Vector2u thumbnailSize = fitSize(image.getSize(), sf::Vector2u(size, size));
+    return downscale(image, sf::IntRect(0, 0, image.getSize().x, image.getSize().y), thumbnailSize.x, thumbnailSize.y);
+}
+
+/**
+ * Returns true if data starts with JPEG start of image marker
+ */
+inline bool isJpeg(const char* data, std::size_t size)
+{
+    return size > 2 && static_cast<unsigned char>(data[0]) == 0xff && static_cast<unsigned char>(data[1]) == 0xd8;
+}
+
+/**
+ * libjpeg error manager that returns to decodeJpeg() instead of exiting
+ */
+struct JpegError
+{
+    jpeg_error_mgr manager;
+    std::jmp_buf jump;
+    
+    static void exit(j_common_ptr info)
+    {
+        std::longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+    }
+    
+    /**
+     * Warnings (e.g, truncated data) are not printed, what could be decoded is shown
+     */
+    static void ignore(j_common_ptr)
+    {
+    }
+};
+
+/**
+ * Decodes JPEG with libjpeg scaling it down in DCT (by 1/2, 1/4 or 1/8) as long
+ * as the result is still at least as big as it needs to be to fit in maxSize,
+ * so that the pixels that would be thrown away are never decoded. Returns
+ * false if it cannot be decoded (e.g, CMYK) so that SFML can try it instead
+ * \param maxSize Zero for full size
+ * \param sourceSize Set to full size of image
+ */
+inline bool decodeJpeg(const char* data, std::size_t size, const sf::Vector2u& maxSize, sf::Image* image, sf::Vector2u* sourceSize)
+{
+    jpeg_decompress_struct info;
+    JpegError error;
+    std::vector<sf::Uint8> pixels;
+    std::vector<JSAMPLE> row;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = JpegError::exit;
+    error.manager.output_message = JpegError::ignore;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, reinterpret_cast<unsigned char*>(const_cast<char*>(data)), static_cast<unsigned long>(size));
+    jpeg_read_header(&info, TRUE);
+    if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK)
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    const sf::Vector2u fullSize(info.image_width, info.image_height);
+    info.out_color_space = JCS_RGB;
+    info.scale_num = 1;
+    info.scale_denom = 1;
+    if (maxSize.x > 0 && maxSize.y > 0)
+    {
+        const sf::Vector2u needed = fitSize(fullSize, maxSize);
+        for (unsigned denominator = 8; denominator > 1; denominator /= 2)
+        {
+            if ((fullSize.x + denominator - 1) / denominator >= needed.x && (fullSize.y + denominator - 1) / denominator >= needed.y)
+            {
+                info.scale_denom = denominator;
+                break;
+            }
+        }
+    }
+    jpeg_start_decompress(&info);
+    
+    const unsigned width = info.output_width;
+    const unsigned height = info.output_height;
+    pixels.resize(static_cast<std::size_t>(width) * height * 4);
+    row.resize(static_cast<std::size_t>(width) * info.output_components);
+    while (info.output_scanline < height)
+    {
+        JSAMPROW rows[] = { row.data() };
+        sf::Uint8* out = &pixels[static_cast<std::size_t>(info.output_scanline) * width * 4];
+        jpeg_read_scanlines(&info, rows, 1);
+        for (unsigned x = 0; x < width; ++x, out += 4)
+        {
+            const JSAMPLE* in = &row[static_cast<std::size_t>(x) * info.output_components];
+            out[0] = in[0];
+            out[1] = in[info.output_components > 1 ? 1 : 0];
+            out[2] = in[info.output_components > 2 ? 2 : 0];
+            out[3] = 255;
+        }
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    
+    image->create(width, height, pixels.data());
+    if (sourceSize != nullptr)
+    {
+        *sourceSize = fullSize;
+    }
+    return true;
+}
+
+/**
+ * Decodes area (in full size coordinates) of JPEG scaled down in DCT by denominator
+ * (1, 2, 4 or 8). Only the rows down to the bottom of area are read and only the
+ * columns around it go through IDCT, so the memory used is that of the area no
+ * matter how big the image is. Returns false if it cannot be decoded (e.g, CMYK) or
+ * libjpeg is not libjpeg-turbo, which is needed for cropping and skipping rows
+ */
+inline bool decodeJpegRegion(const char* data, std::size_t size, const sf::IntRect& area, unsigned denominator, sf::Image* image)
+{
+#ifdef LIBJPEG_TURBO_VERSION
+    jpeg_decompress_struct info;
+    JpegError error;
+    std::vector<sf::Uint8> pixels;
+    std::vector<JSAMPLE> row;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = JpegError::exit;
+    error.manager.output_message = JpegError::ignore;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, reinterpret_cast<unsigned char*>(const_cast<char*>(data)), static_cast<unsigned long>(size));
+    jpeg_read_header(&info, TRUE);
+    if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK || area.left < 0 || area.top < 0)
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    info.out_color_space = JCS_RGB;
+    info.scale_num = 1;
+    info.scale_denom = denominator;
+    jpeg_start_decompress(&info);
+    
+    // area in output (scaled) coordinates
+    const JDIMENSION left = static_cast<JDIMENSION>(area.left) / denominator;
+    const JDIMENSION top = static_cast<JDIMENSION>(area.top) / denominator;
+    const JDIMENSION right = std::min(info.output_width, static_cast<JDIMENSION>(area.left + area.width + denominator - 1) / denominator);
+    const JDIMENSION bottom = std::min(info.output_height, static_cast<JDIMENSION>(area.top + area.height + denominator - 1) / denominator);
+    if (left >= right || top >= bottom)
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    
+    // crop is widened (to iMCU boundaries as well) so that its edges, where chroma
+    // upsampling has no neighbours, are outside of area
+    JDIMENSION cropLeft = left > kJpegCropMargin ? left - kJpegCropMargin : 0;
+    JDIMENSION cropWidth = std::min(info.output_width, right + kJpegCropMargin) - cropLeft;
+    jpeg_crop_scanline(&info, &cropLeft, &cropWidth);
+    if (top > 0)
+    {
+        jpeg_skip_scanlines(&info, top);
+    }
+    
+    const unsigned width = right - left;
+    const unsigned height = bottom - top;
+    pixels.resize(static_cast<std::size_t>(width) * height * 4);
+    row.resize(static_cast<std::size_t>(info.output_width) * info.output_components);
+    for (unsigned y = 0; y < height; ++y)
+    {
+        JSAMPROW rows[] = { row.data() };
+        jpeg_read_scanlines(&info, rows, 1);
+        sf::Uint8* out = &pixels[static_cast<std::size_t>(y) * width * 4];
+        for (unsigned x = 0; x < width; ++x, out += 4)
+        {
+            const JSAMPLE* in = &row[static_cast<std::size_t>(x + left - cropLeft) * info.output_components];
+            out[0] = in[0];
+            out[1] = in[info.output_components > 1 ? 1 : 0];
+            out[2] = in[info.output_components > 2 ? 2 : 0];
+            out[3] = 255;
+        }
+    }
+    // rest of the image is never read
+    jpeg_destroy_decompress(&info);
+    
+    image->create(width, height, pixels.data());
+    return true;
+#else
+    return false; // whole image is decoded instead
+#endif
+}
+
+/**
+ * Represents single item with it's attributes. Items are only moved, never
+ * copied, access them by reference
+ */
+struct Item
+{
+    /**
+     * Raw (encoded) data, shared with whoever is still reading it
+     */
+    std::shared_ptr<const char[]> data;
+    
+    /**
+     * Image size (file size in bytes)
+     */
+    std::size_t size;
+    
+    /**
+     * Filename in archive
+     */
+    std::string name;
+    
+    /**
+     * Index and checksum of entry in zip archive
+     */
+    std::size_t zipIndex = 0;
+    std::uint32_t crc = 0;
+    
+    /**
+     * Archive of photo when viewing library (see library.h), photos of archives that are
+     * not unlocked yet have no data
+     */
+    std::size_t archive = 0;
+    
+    /**
+     * Pixel dimensions and encoded thumbnail when known from the index
+     * file, otherwise zero and empty. Not modified once viewer starts
+     */
+    sf::Vector2u dimensions;
+    std::string thumbnail;
+    
+    Item(std::shared_ptr<const char[]> data_, std::size_t size_, const std::string& name_)
+        : data(std::move(data_)), size(size_), name(name_)
+    {
+    }
+    
+    Item(Item&&) = default;
+    Item& operator=(Item&&) = default;
+    
+    Item(const Item&) = delete;
+    Item& operator=(const Item&) = delete;
+    
+    /**
+     * Decodes the image from raw data, use ImageCache instead of calling it directly.
+     * JPEGs are decoded at reduced resolution by libjpeg, everything else by SFML
+     * \param maxSize Image bigger than this is downscaled to fit in it, zero for full size
+     * \param sourceSize Set to size of image before it was downscaled
+     */
+    std::shared_ptr<const sf::Image> decode(const sf::Vector2u& maxSize = sf::Vector2u(), sf::Vector2u* sourceSize = nullptr) const
+    {
+        MetricsTimer timer("image decode", size);
+        std::shared_ptr<sf::Image> image = std::make_shared<sf::Image>();
+        if (!isJpeg(data.get(), size) || !decodeJpeg(data.get(), size, maxSize, image.get(), sourceSize))
+        {
+            image->loadFromMemory(data.get(), size);
+            if (sourceSize != nullptr)
+            {
+                *sourceSize = image->getSize();
+            }
+        }
+        if (maxSize.x > 0 && maxSize.y > 0)
+        {
+            const sf::Vector2u scaledSize = fitSize(image->getSize(), maxSize);
+            if (scaledSize != image->getSize())
+            {
+                return std::make_shared<const sf::Image>(downscale(*image, sf::IntRect(0, 0, image->getSize().x, image->getSize().y), scaledSize.x, scaledSize.y));
+            }
+        }
+        return image;
+    }
+    
+    /**
+     * Decodes thumbnail known from the index file
+     */
+    std::shared_ptr<const sf::Image> decodeThumbnail() const
+    {
+        MetricsTimer timer("thumbnail decode", thumbnail.size());
+        std::shared_ptr<sf::Image> image = std::make_shared<sf::Image>();
+        image->loadFromMemory(thumbnail.data(), thumbnail.size());
+        return image;
+    }
+};
+
+/**
+ * Decoded images with least recently used one evicted first once the
+ * memory budget is exceeded. Images are downscaled to the display size
+ * when it's set, full size is decoded separately when it's needed. Images are shared so the evicted image stays
+ * valid for whoever is still holding it.
+ *
+ * Cache is shared with prefetch workers, image being decoded by one thread
+ * is waited for by others instead of being decoded twice.
+ *
+ * Thumbnails are created once whenever an image is decoded and are kept
+ * separately (oldest evicted first beyond kMaximumCachedThumbnails)
+ */
+struct ImageCache
+{
+    /**
+     * Memory budget in bytes
+     */
+    std::size_t budget = kDefaultCacheMb * 1024 * 1024;
+    
+    /**
+     * Bytes taken by decoded pixels currently in the cache
+     */
+    std::size_t residentBytes = 0;
+    
+    /**
+     * Bytes of decoded pixels kept outside the cache (e.g, full size image of zoomed
+     * in photo that cannot be decoded by region), counted against the budget
+     */
+    std::size_t externalBytes = 0;
+    
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    
+    /**
+     * Images decoded by prefetch() i.e, ahead of navigation
+     */
+    std::size_t prefetches = 0;
+    
+    /**
+     * Images decoded only to create their thumbnail
+     */
+    std::size_t thumbnailDecodes = 0;
+    
+    /**
+     * Largest image kept in the cache, bigger ones are downscaled to fit (zero for full size)
+     */
+    sf::Vector2u displaySize;
+    
+    /**
+     * Called by whichever thread created the thumbnail from decoded image (without
+     * the lock held), e.g, to collect the thumbnails for index file
+     */
+    std::function<void(std::size_t index, const sf::Vector2u& sourceSize, const sf::Image& thumbnail)> thumbnailCreated;
+    
+    /**
+     * Total number of images decoded
+     */
+    std::size_t decodes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return misses + prefetches + thumbnailDecodes;
+    }
+    
+    /**
+     * Item index and its image, most recently used first
+     */
+    std::list<std::pair<std::size_t, std::shared_ptr<const sf::Image>>> entries;
+    
+    std::unordered_map<std::size_t, decltype(entries)::iterator> lookup;
+    
+    /**
+     * Thumbnail of each item index and the order they were created in
+     */
+    std::unordered_map<std::size_t, std::shared_ptr<const sf::Image>> thumbnails;
+    std::deque<std::size_t> thumbnailOrder;
+    
+    /**
+     * Size of each decoded image before it was downscaled
+     */
+    std::unordered_map<std::size_t, sf::Vector2u> sourceSizes;
+    
+    /**
+     * Indices being decoded at the moment
+     */
+    std::set<std::size_t> decoding;
+    
+    mutable std::mutex mutex;
+    
+    std::condition_variable decoded;
+    
+    /**
+     * Returns image for item at index, decoding it if it's not in the cache
+     */
+    std::shared_ptr<const sf::Image> get(std::size_t index, const Item& item)
+    {
+        return load(index, item, false);
+    }
+    
+    /**
+     * Decodes image for item at index in to the cache unless it's already there
+     */
+    void prefetch(std::size_t index, const Item& item)
+    {
+        load(index, item, true);
+    }
+    
+    /**
+     * Returns image for item at index if it's in the cache, otherwise nullptr
+     * (this does not affect the statistics or the order of eviction)
+     */
+    std::shared_ptr<const sf::Image> peek(std::size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = lookup.find(index);
+        return found == lookup.end() ? nullptr : found->second->second;
+    }
+    
+    /**
+     * Returns full size of image at index if it has been decoded or is in the index file, otherwise zero
+     */
+    sf::Vector2u sourceSize(std::size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = sourceSizes.find(index);
+        return found == sourceSizes.end() ? sf::Vector2u() : found->second;
+    }
+    
+    /**
+     * Returns thumbnail for item at index if it has been created, otherwise nullptr
+     */
+    std::shared_ptr<const sf::Image> peekThumbnail(std::size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = thumbnails.find(index);
+        return found == thumbnails.end() ? nullptr : found->second;
+    }
+    
+    /**
+     * Returns thumbnail for item at index, decoding the one from index file
+     * or creating it from cached image or decoding the image (without
+     * caching it) if needed
+     */
+    std::shared_ptr<const sf::Image> loadThumbnail(std::size_t index, const Item& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        decoded.wait(lock, [&]() { return decoding.count(index) == 0; });
+        const auto found = thumbnails.find(index);
+        if (found != thumbnails.end())
+        {
+            return found->second;
+        }
+        std::shared_ptr<const sf::Image> image;
+        const auto cached = lookup.find(index);
+        if (cached != lookup.end())
+        {
+            image = cached->second->second;
+        }
+        else if (item.thumbnail.empty())
+        {
+            ++thumbnailDecodes;
+        }
+        decoding.insert(index);
+        
+        const auto knownSize = sourceSizes.find(index);
+        sf::Vector2u size = knownSize == sourceSizes.end() ? item.dimensions : knownSize->second;
+        
+        lock.unlock();
+        std::shared_ptr<const sf::Image> thumbnail;
+        if (!image && !item.thumbnail.empty())
+        {
+            thumbnail = item.decodeThumbnail();
+        }
+        else
+        {
+            if (!image)
+            {
+                image = item.decode(sf::Vector2u(kThumbnailSize, kThumbnailSize), &size);
+            }
+            thumbnail = std::make_shared<const sf::Image>(createThumbnail(*image, kThumbnailSize));
+            if (thumbnailCreated)
+            {
+                thumbnailCreated(index, size, *thumbnail);
+            }
+        }
+        lock.lock();
+        
+        decoding.erase(index);
+        if (size.x > 0)
+        {
+            sourceSizes[index] = size;
+        }
+        addThumbnail(index, thumbnail);
+        decoded.notify_all();
+        return thumbnail;
+    }
+    
+    /**
+     * Keeps only the image of item at index, as image of item at newIndex, when
+     * the list is replaced. Must not be called while anything is being decoded.
+     * Thumbnail is dropped as well so that it is created again (and reported
+     * through thumbnailCreated) for the new list
+     */
+    void reindex(std::size_t index, std::size_t newIndex)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = lookup.find(index);
+        std::shared_ptr<const sf::Image> image = found == lookup.end() ? nullptr : found->second->second;
+        const auto knownSize = sourceSizes.find(index);
+        const sf::Vector2u size = knownSize == sourceSizes.end() ? sf::Vector2u() : knownSize->second;
+        
+        entries.clear();
+        lookup.clear();
+        thumbnails.clear();
+        thumbnailOrder.clear();
+        sourceSizes.clear();
+        residentBytes = 0;
+        if (image)
+        {
+            entries.emplace_front(newIndex, image);
+            lookup[newIndex] = entries.begin();
+            residentBytes = imageBytes(*image);
+        }
+        if (size.x > 0)
+        {
+            sourceSizes[newIndex] = size;
+        }
+    }
+    
+    /**
+     * Sets bytes kept outside the cache, cached images are evicted to make room for them
+     */
+    void setExternalBytes(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        externalBytes = bytes;
+        evict();
+    }
+    
+    bool isDecoding(std::size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return decoding.count(index) > 0;
+    }
+    
+    std::shared_ptr<const sf::Image> load(std::size_t index, const Item& item, bool prefetching)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        decoded.wait(lock, [&]() { return decoding.count(index) == 0; });
+        const auto found = lookup.find(index);
+        if (found != lookup.end())
+        {
+            if (!prefetching)
+            {
+                ++hits;
+            }
+            entries.splice(entries.begin(), entries, found->second);
+            return found->second->second;
+        }
+        ++(prefetching ? prefetches : misses);
+        decoding.insert(index);
+        
+        const bool needsThumbnail = thumbnails.count(index) == 0 && item.thumbnail.empty();
+        
+        // decode without holding the lock
+        lock.unlock();
+        sf::Vector2u size;
+        std::shared_ptr<const sf::Image> image = item.decode(displaySize, &size);
+        std::shared_ptr<const sf::Image> thumbnail;
+        if (needsThumbnail)
+        {
+            thumbnail = std::make_shared<const sf::Image>(createThumbnail(*image, kThumbnailSize));
+            if (thumbnailCreated)
+            {
+                thumbnailCreated(index, size, *thumbnail);
+            }
+        }
+        lock.lock();
+        
+        decoding.erase(index);
+        sourceSizes[index] = size;
+        if (thumbnail)
+        {
+            addThumbnail(index, thumbnail);
+        }
+        entries.emplace_front(index, image);
+        lookup[index] = entries.begin();
+        residentBytes += imageBytes(*image);
+        evict();
+        decoded.notify_all();
+        return image;
+    }
+    
+    void addThumbnail(std::size_t index, const std::shared_ptr<const sf::Image>& thumbnail)
+    {
+        if (thumbnails.emplace(index, thumbnail).second)
+        {
+            thumbnailOrder.push_back(index);
+        }
+        while (thumbnailOrder.size() > kMaximumCachedThumbnails)
+        {
+            thumbnails.erase(thumbnailOrder.front());
+            thumbnailOrder.pop_front();
+        }
+    }
+    
+    /**
+     * Evicts least recently used images until resident (and external) bytes are within
+     * budget, most recent image is always kept even if it's bigger than the budget
+     */
+    void evict()
+    {
+        while (residentBytes + externalBytes > budget && entries.size() > 1)
+        {
+            residentBytes -= imageBytes(*entries.back().second);
+            lookup.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+    
+    void report(std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        os << "Image cache: " << hits << " hits, " << misses << " misses, "
+           << prefetches << " prefetched, " << thumbnailDecodes << " decoded for thumbnail, "
+           << entries.size() << " images resident (" << (residentBytes / 1024 / 1024)
+           << " / " << (budget / 1024 / 1024) << " MB, " << (externalBytes / 1024 / 1024) << " MB outside), " << thumbnails.size() << " thumbnails" << std::endl;
+    }
+    
+    static std::size_t imageBytes(const sf::Image& image)
+    {
+        return static_cast<std::size_t>(image.getSize().x) * image.getSize().y * 4;
+    }
+};
+
+/**
+ * Decodes photos around the current one on worker threads so that they
+ * are already in the cache when user navigates to them
+ */
+struct Prefetcher
+{
+    /**
+     * Number of photos ahead (in direction of navigation) to decode, one
+     * photo behind is decoded as well
+     */
+    std::size_t count = kDefaultPrefetch;
+    
+    const std::vector<Item>* items = nullptr;
+    
+    ImageCache* cache = nullptr;
+    
+    std::vector<std::thread> workers;
+    
+    /**
+     * Indices waiting to be decoded, first one is picked up first. Second of
+     * the pair is true if only the thumbnail is needed
+     */
+    std::deque<std::pair<std::size_t, bool>> queue;
+    
+    bool stopping = false;
+    
+    std::mutex mutex;
+    
+    std::condition_variable queued;
+    
+    ~Prefetcher()
+    {
+        stop();
+    }
+    
+    void start(const std::vector<Item>* items_, ImageCache* cache_, std::size_t threadCount)
+    {
+        items = items_;
+        cache = cache_;
+        stopping = false;
+        for (std::size_t i = 0; i < threadCount; ++i)
+        {
+            workers.emplace_back(&Prefetcher::run, this);
+        }
+    }
+    
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            queue.clear();
+        }
+        queued.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+    }
+    
+    bool isRunning() const
+    {
+        return !workers.empty();
+    }
+    
+    /**
+     * Changes data of items (by calling change) while no worker is picking up a photo.
+     * Workers decode from their own reference to the data, so the ones decoding
+     * meanwhile keep going and are not waited for
+     */
+    template <typename Change>
+    void changeItems(Change change)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        change();
+    }
+    
+    /**
+     * Replaces photos waiting with neighbours of index, requested thumbnails
+     * stay behind them. Photos that are already being decoded are finished
+     * as decoding cannot be interrupted
+     * \param direction 1 when moving forward, -1 when moving backward
+     */
+    void schedule(std::size_t index, int direction)
+    {
+        if (!isRunning() || items->empty())
+        {
+            return;
+        }
+        const long total = static_cast<long>(items->size());
+        const auto wrap = [&](long i) { return static_cast<std::size_t>(((i % total) + total) % total); };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.erase(std::remove_if(queue.begin(), queue.end(), [](const std::pair<std::size_t, bool>& job) {
+                    return !job.second;
+                }), queue.end());
+            std::vector<std::pair<std::size_t, bool>> jobs;
+            for (std::size_t i = 1; i <= count && i < items->size(); ++i)
+            {
+                jobs.emplace_back(wrap(static_cast<long>(index) + direction * static_cast<long>(i)), false);
+            }
+            if (count > 0 && items->size() > 2)
+            {
+                jobs.emplace_back(wrap(static_cast<long>(index) - direction), false);
+            }
+            queue.insert(queue.begin(), jobs.begin(), jobs.end());
+        }
+        queued.notify_all();
+    }
+    
+    /**
+     * Adds thumbnail of index to the end of the queue unless it's already waiting or being decoded
+     */
+    void requestThumbnail(std::size_t index)
+    {
+        if (!isRunning() || cache->isDecoding(index))
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (std::find_if(queue.begin(), queue.end(), [&](const std::pair<std::size_t, bool>& job) {
+                    return job.first == index && job.second;
+                }) != queue.end())
+            {
+                return;
+            }
+            queue.emplace_back(index, true);
+        }
+        queued.notify_one();
+    }
+    
+    void run()
+    {
+        while (true)
+        {
+            std::pair<std::size_t, bool> job;
+            std::unique_ptr<Item> item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (stopping)
+                {
+                    return;
+                }
+                job = queue.front();
+                queue.pop_front();
+                const Item& source = items->at(job.first);
+                if (!source.data)
+                {
+                    continue; // not read yet or released (library)
+                }
+                // copy of the item holds on to the data, see changeItems()
+                item.reset(new Item(source.data, source.size, source.name));
+                item->dimensions = source.dimensions;
+                item->thumbnail = source.thumbnail;
+            }
+            if (job.second)
+            {
+                cache->loadThumbnail(job.first, *item);
+            }
+            else
+            {
+                cache->prefetch(job.first, *item);
+            }
+        }
+    }
+};
+
+#endif // GALLERY_H
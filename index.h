@@ -0,0 +1,346 @@
+/**
+ * Encrypted sidecar index of an archive (<archive>.index) so that the
+ * thumbnails and dimensions of photos are not decoded again on every launch
+ *
+ * Index is encrypted with the same key and stored in the same format as the
+ * archive, i.e, <IV>:<Base-64 of Encrypted Index>. Contents before encryption
+ * (numbers in host byte order as index is never moved between machines):
+ *     magic, archive size, archive modification time, archive IV, entry count
+ *     and for each entry: zip index, name, size, CRC, width, height, JPEG thumbnail
+ *
+ * Index is ignored as a whole when archive's size, modification time or IV
+ * changes and entry by entry when the name, size or CRC of entry changes
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <SFML/Graphics.hpp>
+
+#include "external/mine.h"
+#include "gallery.h"
+
+/**
+ * First bytes of decrypted index, changes whenever the format changes
+ */
+static const char kIndexMagic[8] = { 'S', 'P', 'V', 'I', 'D', 'X', '0', '1' };
+
+/**
+ * Extension added to archive name for index
+ */
+static const std::string kIndexExtension = ".index";
+
+/**
+ * Bounds checked reading of decrypted index
+ */
+struct IndexReader
+{
+    const std::string& contents;
+    std::size_t position;
+    
+    template <typename T>
+    T read()
+    {
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    
+    std::string readString(std::size_t len)
+    {
+        return std::string(take(len), len);
+    }
+    
+    const char* take(std::size_t len)
+    {
+        if (len > contents.size() - position)
+        {
+            throw std::runtime_error("Truncated index");
+        }
+        position += len;
+        return contents.data() + position - len;
+    }
+};
+
+/**
+ * Appends value to index contents (host byte order)
+ */
+template <typename T>
+inline void appendIndexValue(std::string* contents, T value)
+{
+    contents->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Reads and decrypts index file (<IV>:<Base-64 of Encrypted Index>) in to contents,
+ * returns false if it does not exist. Throws if it cannot be decrypted
+ */
+inline bool readEncryptedIndex(const std::string& filename, const std::string& key, std::string* contents)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    char header[33];
+    if (!ifs.read(header, sizeof(header)) || header[32] != ':')
+    {
+        return false;
+    }
+    mine::AES aesManager;
+    aesManager.setKey(key);
+    aesManager.decr(ifs, mine::Base16::fromString(std::string(header, 32)), [&](const mine::byte* data, std::size_t len) {
+        contents->append(reinterpret_cast<const char*>(data), len);
+    }, mine::MineCommon::Encoding::Base64);
+    return true;
+}
+
+/**
+ * Encrypts contents in to index file, written next to it and renamed so that an
+ * interrupted write does not leave a broken index
+ */
+inline void writeEncryptedIndex(const std::string& filename, const std::string& key, const std::string& contents)
+{
+    mine::AES aesManager;
+    aesManager.setKey(key);
+    std::string iv;
+    const std::string encrypted = aesManager.encr(contents, iv, mine::MineCommon::Encoding::Raw, mine::MineCommon::Encoding::Base64);
+    
+    const std::string temporaryFilename = filename + ".tmp";
+    {
+        std::ofstream ofs(temporaryFilename, std::ios::binary | std::ios::trunc);
+        ofs << iv << ':' << encrypted;
+        if (!ofs.flush())
+        {
+            throw std::runtime_error("Unable to write index [" + temporaryFilename + "]");
+        }
+    }
+    std::filesystem::rename(temporaryFilename, filename);
+}
+
+/**
+ * Single photo in index
+ */
+struct IndexEntry
+{
+    std::uint64_t zipIndex = 0;
+    std::string name;
+    std::uint64_t size = 0;
+    std::uint32_t crc = 0;
+    sf::Vector2u dimensions;
+    
+    /**
+     * Thumbnail encoded as JPEG
+     */
+    std::string thumbnail;
+};
+
+struct ArchiveIndex
+{
+    /**
+     * Index filename
+     */
+    std::string filename;
+    
+    /**
+     * Key of archive (Base-16)
+     */
+    std::string key;
+    
+    /**
+     * Size, modification time and IV of archive, index is stale if any of them differs
+     */
+    std::uint64_t archiveSize = 0;
+    std::int64_t archiveModified = 0;
+    std::string archiveIV;
+    
+    /**
+     * Entries by zip index
+     */
+    std::map<std::uint64_t, IndexEntry> entries;
+    
+    /**
+     * True when entries are added since index was read
+     */
+    bool changed = false;
+    
+    std::mutex mutex;
+    
+    ArchiveIndex(const std::string& archiveFilename, const std::string& key_)
+        : filename(archiveFilename + kIndexExtension), key(key_)
+    {
+        archiveSize = std::filesystem::file_size(archiveFilename);
+        archiveModified = static_cast<std::int64_t>(std::filesystem::last_write_time(archiveFilename).time_since_epoch().count());
+        std::ifstream ifs(archiveFilename, std::ios::binary);
+        char iv[32];
+        if (ifs.read(iv, sizeof(iv)))
+        {
+            archiveIV.assign(iv, sizeof(iv));
+        }
+    }
+    
+    /**
+     * Reads the index file, returns false (and leaves the entries empty)
+     * if it does not exist, is stale or cannot be decrypted
+     */
+    bool read()
+    {
+        std::map<std::uint64_t, IndexEntry> result;
+        try
+        {
+            std::string contents;
+            if (!readEncryptedIndex(filename, key, &contents))
+            {
+                return false;
+            }
+            
+            IndexReader reader{ contents, 0 };
+            if (reader.readString(sizeof(kIndexMagic)) != std::string(kIndexMagic, sizeof(kIndexMagic))
+                || reader.read<std::uint64_t>() != archiveSize
+                || reader.read<std::int64_t>() != archiveModified
+                || reader.readString(reader.read<std::uint32_t>()) != archiveIV)
+            {
+                return false;
+            }
+            const std::uint64_t total = reader.read<std::uint64_t>();
+            for (std::uint64_t i = 0; i < total; ++i)
+            {
+                IndexEntry entry;
+                entry.zipIndex = reader.read<std::uint64_t>();
+                entry.name = reader.readString(reader.read<std::uint32_t>());
+                entry.size = reader.read<std::uint64_t>();
+                entry.crc = reader.read<std::uint32_t>();
+                entry.dimensions.x = reader.read<std::uint32_t>();
+                entry.dimensions.y = reader.read<std::uint32_t>();
+                entry.thumbnail = reader.readString(reader.read<std::uint32_t>());
+                result[entry.zipIndex] = std::move(entry);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Ignoring index [" << filename << "]: " << e.what() << std::endl;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        entries = std::move(result);
+        changed = false;
+        return true;
+    }
+    
+    /**
+     * Sets dimensions and thumbnail of items that are in the index
+     * (must be called before items are shared with other threads)
+     * \return Number of items found in the index
+     */
+    std::size_t apply(std::vector<Item>* items)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::size_t found = 0;
+        for (Item& item : *items)
+        {
+            const auto entry = entries.find(item.zipIndex);
+            if (entry != entries.end()
+                && entry->second.name == item.name
+                && entry->second.size == item.size
+                && entry->second.crc == item.crc)
+            {
+                item.dimensions = entry->second.dimensions;
+                item.thumbnail = entry->second.thumbnail;
+                ++found;
+            }
+        }
+        return found;
+    }
+    
+    /**
+     * Adds thumbnail created for item, called from any thread
+     */
+    void add(const Item& item, const sf::Vector2u& dimensions, const sf::Image& thumbnail)
+    {
+        IndexEntry entry;
+        entry.zipIndex = item.zipIndex;
+        entry.name = item.name;
+        entry.size = item.size;
+        entry.crc = item.crc;
+        entry.dimensions = dimensions;
+        std::vector<sf::Uint8> encoded;
+        if (!thumbnail.saveToMemory(encoded, "jpg"))
+        {
+            return;
+        }
+        entry.thumbnail.assign(encoded.begin(), encoded.end());
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[entry.zipIndex] = std::move(entry);
+        changed = true;
+    }
+    
+    /**
+     * Writes entries of items to the index file if anything has been added,
+     * entries of photos no longer in the archive are dropped
+     * \return True if the index file was written
+     */
+    bool write(const std::vector<Item>& items)
+    {
+        std::string contents;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!changed)
+            {
+                return false;
+            }
+            std::vector<const IndexEntry*> current;
+            for (const Item& item : items)
+            {
+                const auto entry = entries.find(item.zipIndex);
+                if (entry != entries.end()
+                    && entry->second.name == item.name
+                    && entry->second.size == item.size
+                    && entry->second.crc == item.crc)
+                {
+                    current.push_back(&entry->second);
+                }
+            }
+            contents.append(kIndexMagic, sizeof(kIndexMagic));
+            append(&contents, archiveSize);
+            append(&contents, archiveModified);
+            append(&contents, static_cast<std::uint32_t>(archiveIV.size()));
+            contents.append(archiveIV);
+            append(&contents, static_cast<std::uint64_t>(current.size()));
+            for (const IndexEntry* entry : current)
+            {
+                append(&contents, entry->zipIndex);
+                append(&contents, static_cast<std::uint32_t>(entry->name.size()));
+                contents.append(entry->name);
+                append(&contents, entry->size);
+                append(&contents, entry->crc);
+                append(&contents, static_cast<std::uint32_t>(entry->dimensions.x));
+                append(&contents, static_cast<std::uint32_t>(entry->dimensions.y));
+                append(&contents, static_cast<std::uint32_t>(entry->thumbnail.size()));
+                contents.append(entry->thumbnail);
+            }
+            changed = false;
+        }
+        
+        writeEncryptedIndex(filename, key, contents);
+        return true;
+    }
+
+private:
+    template <typename T>
+    static void append(std::string* contents, T value)
+    {
+        appendIndexValue(contents, value);
+    }
+};
+
+#endif // INDEX_H
@@ -0,0 +1,355 @@
+/**
+ * Library of archives, i.e, directory of archives encrypted with the same key
+ * viewed as one list of photos
+ *
+ * Entries of every archive are kept in encrypted library index in the directory
+ * (.secure-photo-library) in the same format as archive index (see index.h) so
+ * that opening the library does not decrypt any archive but the one whose photo
+ * is viewed first. Other archives are unlocked (decrypted and read) only once
+ * one of their photos is viewed. Contents before encryption (numbers in host
+ * byte order):
+ *     magic, archive count and for each archive: filename, size, modification
+ *     time, entry count and for each entry: zip index, name, size, CRC, date
+ *
+ * Archive is listed again when its size or modification time changes
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <cstdint>
+
+#include "external/libzippp.h"
+#include "gallery.h"
+#include "index.h"
+#include "archive.h"
+#include "unpack.h"
+
+/**
+ * First bytes of decrypted library index, changes whenever the format changes
+ */
+static const char kLibraryMagic[8] = { 'S', 'P', 'V', 'L', 'I', 'B', '0', '1' };
+
+/**
+ * Library index filename in library directory
+ */
+static const std::string kLibraryIndexFilename = ".secure-photo-library";
+
+/**
+ * Single photo of library
+ */
+struct LibraryEntry
+{
+    std::uint64_t zipIndex = 0;
+    std::string name;
+    std::uint64_t size = 0;
+    std::uint32_t crc = 0;
+    
+    /**
+     * Modification time of entry in zip (seconds since epoch)
+     */
+    std::int64_t date = 0;
+};
+
+/**
+ * Archive in library
+ */
+struct LibraryArchive
+{
+    enum class State
+    {
+        Locked,
+        Unlocking,
+        Unlocked,
+        Failed
+    };
+    
+    std::string filename;
+    std::uint64_t size = 0;
+    std::int64_t modified = 0;
+    
+    /**
+     * True once entries are known (from library index or archive itself)
+     */
+    bool listed = false;
+    std::vector<LibraryEntry> entries;
+    
+    /**
+     * Whether photos are read (main thread only)
+     */
+    State state = State::Locked;
+};
+
+struct Library
+{
+    std::string directory;
+    
+    /**
+     * Key of archives (Base-16)
+     */
+    std::string key;
+    
+    /**
+     * Lock photos of unlocked archives in memory, see SecureArena
+     */
+    bool lockMemory = false;
+    
+    /**
+     * Archives sorted by filename, never added or removed once library is open
+     */
+    std::vector<LibraryArchive> archives;
+    
+    /**
+     * True when archives are listed since library index was read
+     */
+    bool changed = false;
+    
+    /**
+     * Finds the archives (version 1 or 2) in directory, hidden files and archive indexes are skipped
+     */
+    Library(const std::string& directory_, const std::string& key_, bool lockMemory_)
+        : directory(directory_), key(key_), lockMemory(lockMemory_)
+    {
+        for (const auto& file : std::filesystem::directory_iterator(directory))
+        {
+            const std::string name = file.path().filename().string();
+            if (!file.is_regular_file() || name.empty() || name[0] == '.' || endsWith(name, kIndexExtension) || !isArchive(file.path().string()))
+            {
+                continue;
+            }
+            LibraryArchive archive;
+            archive.filename = file.path().string();
+            archive.size = file.file_size();
+            archive.modified = static_cast<std::int64_t>(file.last_write_time().time_since_epoch().count());
+            archives.push_back(std::move(archive));
+        }
+        std::sort(archives.begin(), archives.end(), [](const LibraryArchive& a, const LibraryArchive& b) {
+            return a.filename < b.filename;
+        });
+    }
+    
+    /**
+     * Returns true if file is version 1 (<IV>:<B64>) or version 2 archive
+     */
+    static bool isArchive(const std::string& filename)
+    {
+        std::ifstream ifs(filename, std::ios::binary);
+        char header[33];
+        return (ifs.read(header, sizeof(header)) && header[32] == ':') || isChunkedArchive(filename);
+    }
+    
+    std::string indexFilename() const
+    {
+        return (std::filesystem::path(directory) / kLibraryIndexFilename).string();
+    }
+    
+    /**
+     * Takes entries of archives that have not changed from library index
+     * \return Number of archives listed from index
+     */
+    std::size_t read()
+    {
+        std::size_t found = 0;
+        try
+        {
+            std::string contents;
+            if (!readEncryptedIndex(indexFilename(), key, &contents))
+            {
+                return 0;
+            }
+            IndexReader reader{ contents, 0 };
+            if (reader.readString(sizeof(kLibraryMagic)) != std::string(kLibraryMagic, sizeof(kLibraryMagic)))
+            {
+                return 0;
+            }
+            std::map<std::string, LibraryArchive*> byName;
+            for (LibraryArchive& archive : archives)
+            {
+                byName[std::filesystem::path(archive.filename).filename().string()] = &archive;
+            }
+            const std::uint64_t total = reader.read<std::uint64_t>();
+            for (std::uint64_t i = 0; i < total; ++i)
+            {
+                const std::string name = reader.readString(reader.read<std::uint32_t>());
+                const std::uint64_t size = reader.read<std::uint64_t>();
+                const std::int64_t modified = reader.read<std::int64_t>();
+                const std::uint64_t count = reader.read<std::uint64_t>();
+                if (count > contents.size())
+                {
+                    throw std::runtime_error("Truncated index");
+                }
+                std::vector<LibraryEntry> entries(static_cast<std::size_t>(count));
+                for (LibraryEntry& entry : entries)
+                {
+                    entry.zipIndex = reader.read<std::uint64_t>();
+                    entry.name = reader.readString(reader.read<std::uint32_t>());
+                    entry.size = reader.read<std::uint64_t>();
+                    entry.crc = reader.read<std::uint32_t>();
+                    entry.date = reader.read<std::int64_t>();
+                }
+                const auto archive = byName.find(name);
+                if (archive != byName.end() && archive->second->size == size && archive->second->modified == modified)
+                {
+                    archive->second->entries = std::move(entries);
+                    archive->second->listed = true;
+                    ++found;
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Ignoring library index [" << indexFilename() << "]: " << e.what() << std::endl;
+            for (LibraryArchive& archive : archives)
+            {
+                archive.entries.clear();
+                archive.listed = false;
+            }
+            return 0;
+        }
+        return found;
+    }
+    
+    /**
+     * Sets entries of archive from its photos
+     */
+    void list(std::size_t index, const std::vector<libzippp::ZipEntry>& entries)
+    {
+        LibraryArchive& archive = archives.at(index);
+        archive.entries.clear();
+        for (const libzippp::ZipEntry& zipEntry : entries)
+        {
+            LibraryEntry entry;
+            entry.zipIndex = zipEntry.getIndex();
+            entry.name = zipEntry.getName();
+            entry.size = zipEntry.getSize();
+            entry.crc = static_cast<std::uint32_t>(zipEntry.getCRC());
+            entry.date = static_cast<std::int64_t>(zipEntry.getDate());
+            archive.entries.push_back(std::move(entry));
+        }
+        archive.listed = true;
+        changed = true;
+    }
+    
+    /**
+     * Writes entries of listed archives to library index if any archive has been listed
+     * \return True if library index was written
+     */
+    bool write()
+    {
+        if (!changed)
+        {
+            return false;
+        }
+        std::string contents(kLibraryMagic, sizeof(kLibraryMagic));
+        appendIndexValue(&contents, static_cast<std::uint64_t>(std::count_if(archives.begin(), archives.end(), [](const LibraryArchive& archive) {
+            return archive.listed;
+        })));
+        for (const LibraryArchive& archive : archives)
+        {
+            if (!archive.listed)
+            {
+                continue;
+            }
+            const std::string name = std::filesystem::path(archive.filename).filename().string();
+            appendIndexValue(&contents, static_cast<std::uint32_t>(name.size()));
+            contents.append(name);
+            appendIndexValue(&contents, archive.size);
+            appendIndexValue(&contents, archive.modified);
+            appendIndexValue(&contents, static_cast<std::uint64_t>(archive.entries.size()));
+            for (const LibraryEntry& entry : archive.entries)
+            {
+                appendIndexValue(&contents, entry.zipIndex);
+                appendIndexValue(&contents, static_cast<std::uint32_t>(entry.name.size()));
+                contents.append(entry.name);
+                appendIndexValue(&contents, entry.size);
+                appendIndexValue(&contents, entry.crc);
+                appendIndexValue(&contents, entry.date);
+            }
+        }
+        writeEncryptedIndex(indexFilename(), key, contents);
+        changed = false;
+        return true;
+    }
+    
+    /**
+     * Returns photos of all listed archives in order, without their data (see unlock())
+     */
+    std::vector<Item> createItems() const
+    {
+        std::vector<Item> items;
+        for (std::size_t i = 0; i < archives.size(); ++i)
+        {
+            for (const LibraryEntry& entry : archives[i].entries)
+            {
+                items.emplace_back(nullptr, static_cast<std::size_t>(entry.size), entry.name);
+                items.back().zipIndex = entry.zipIndex;
+                items.back().crc = entry.crc;
+                items.back().archive = i;
+            }
+        }
+        return items;
+    }
+    
+    /**
+     * Decrypts archive and reads its photos, called from any thread
+     */
+    std::vector<Item> unlock(std::size_t index) const
+    {
+        const std::unique_ptr<OpenArchive> archive = openArchive(archives.at(index).filename, key, lockMemory);
+        std::vector<Item> items;
+        readItems(*archive->zip, listImages(*archive->zip), std::make_shared<SecureArena>(lockMemory), archive->buffer, &items);
+        archive->zip->close();
+        for (Item& item : items)
+        {
+            item.archive = index;
+        }
+        return items;
+    }
+    
+    /**
+     * Gives data of unlocked photos to the same photos (by zip index, name and size) in
+     * list. Photos must not be read by any other thread meanwhile
+     * \return Number of photos unlocked
+     */
+    static std::size_t apply(std::vector<Item>* list, std::vector<Item> unlocked)
+    {
+        if (unlocked.empty())
+        {
+            return 0;
+        }
+        std::map<std::uint64_t, Item*> byZipIndex;
+        for (Item& item : unlocked)
+        {
+            byZipIndex[item.zipIndex] = &item;
+        }
+        std::size_t found = 0;
+        for (Item& item : *list)
+        {
+            if (item.archive != unlocked.front().archive || item.data)
+            {
+                continue;
+            }
+            const auto match = byZipIndex.find(item.zipIndex);
+            if (match != byZipIndex.end() && match->second->name == item.name && match->second->size == item.size)
+            {
+                item.data = std::move(match->second->data);
+                ++found;
+            }
+        }
+        return found;
+    }
+};
+
+#endif // LIBRARY_H
@@ -4,12 +4,36 @@
  *
  * The contents of archive is expected to be in following format
  *     <IV>:<Base-64 of Encrypted Zip File>
+ * or chunked archive created by secure-photo-packer (see archive.h)
  *
- * Full compile command: g++ main.cc external/libzippp.cpp external/mine.cc -I/usr/local/lib -lsfml-graphics  -lsfml-window -lsfml-system -lzip -lz -std=c++11 -O3 -o secure-photo-viewer
+ * Full compile command: g++ main.cc external/libzippp.cpp external/mine.cc -I/usr/local/lib -lsfml-graphics  -lsfml-window -lsfml-system -ljpeg -lzip -lz -std=c++17 -pthread -O3 -o secure-photo-viewer
  *
  * In order to run program you will need to provide AES key in first 
  * param and archive name in second, e.g,
- *    ./secure-photo-viewer <archive> [<key> = ""] [<initial_index> = 0]
+ *    ./secure-photo-viewer <archive or library directory> [<key> = ""] [<initial_index> = 0] [options]
+ *
+ * Options:
+ *      --cache-mb=<N>: Memory budget for decoded images in MB (default: 512)
+ *      --prefetch=<N>: Number of photos decoded ahead in background, 0 to disable (default: 3)
+ *      --fps=<N>: Maximum frames per second, 0 for no limit (default: 0). Frames
+ *               are only drawn when something changes regardless
+ *      --index: Keep encrypted index of thumbnails in <archive>.index for faster startup,
+ *               missing thumbnails are created in background (encrypted archives only)
+ *      --metrics[=<file>]: Record time and bytes of each phase (file read, decryption, inflate,
+ *               decode, texture upload, frames) and write JSON summary at exit to file or
+ *               standard output. Same as SPV_METRICS=<file> (or 1) environment variable
+ *      --trace=<file>: Write every recorded phase as Chrome trace events, same as SPV_TRACE=<file>
+ *      --lock-memory: Lock decrypted archive and photos in memory (mlock) so that they are
+ *               never swapped to disk, limited by ulimit -l
+ *      --export[=<selection>]: Export photos (e.g, 1-10,15, all of them by default) to save path
+ *               in background once archive is loaded, progress is shown in the title
+ *
+ * Window opens right away, initial photo is shown as soon as it is read and the rest
+ * of the archive is read in background with progress in the title
+ *
+ * Directory of archives encrypted with the same key is opened as library (see library.h),
+ * photos of all the archives are listed but each archive is decrypted only when one of
+ * its photos is viewed. --index is not used for library
  *
  * Keys:
  *      - Right Arrow: Next photo / Re-position when zoomed
@@ -20,6 +44,8 @@
  *      - Backspace: Zoom Out
  *      - Backslash (\): Reset Zoom
  *      - F: Enter/exit Fullscreen
+ *      - I: Print image cache statistics
+ *      - E: Export all the photos to save path in background
  *      - Escape: Exit
  *
  * Author: abumq (Majid Q.)
@@ -28,7 +54,17 @@
 
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
 #include <utility>
+#include <stdexcept>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
@@ -39,6 +75,13 @@
 #include "external/mine.h"
 #include "external/libzippp.h"
 #include "external/rc.h"
+#include "gallery.h"
+#include "index.h"
+#include "archive.h"
+#include "unpack.h"
+#include "library.h"
+#include "export.h"
+#include "metrics.h"
 
 namespace fs = std::filesystem;
 
@@ -73,45 +116,538 @@ static const float kRightAngle = 90;
 static const int kMaximumThumbnails = 20;
 
 /**
- * Size of thumbnail in pixels
+ * Number of thumbnail slots in each row and column of thumbnail atlas
+ */
+static const unsigned kThumbnailAtlasSlots = 8;
+
+/**
+ * Size of tiles (in pixels) of zoomed in photo
+ */
+static const unsigned kTileSize = 512;
+
+/**
+ * Maximum number of tiles kept on the GPU (each tile is up to 1 MB)
+ */
+static const std::size_t kMaximumTiles = 96;
+
+/**
+ * How often thumbnail strip (and zoomed in photo) is redrawn while thumbnails (and tiles)
+ * are still being created
+ */
+static const sf::Time kPendingThumbnailsInterval = sf::milliseconds(50);
+
+/**
+ * Number of photos read from archive at a time while loading in background
+ */
+static const std::size_t kLoadBatchSize = 64;
+
+/**
+ * Maximum number of archives of library kept unlocked, photos of archives furthest
+ * from the current photo are released (and unlocked again when viewed)
+ */
+static const std::size_t kMaximumUnlockedArchives = 4;
+
+/**
+ * Single texture holding pre-scaled thumbnails so that the whole strip is
+ * drawn in one call. When all the slots are taken, least recently used
+ * one is reused
  */
-static const std::size_t kThumbnailSize = 128;
+struct ThumbnailAtlas
+{
+    sf::Texture texture;
+    
+    /**
+     * Item index in each slot (-1 if free), size of thumbnail in slot
+     * and frame it was last used in
+     */
+    std::vector<long> owners;
+    std::vector<sf::Vector2u> sizes;
+    std::vector<std::size_t> lastUsed;
+    
+    std::size_t frame = 0;
+    
+    /**
+     * Creates texture, needs to be called after window is created
+     */
+    void create()
+    {
+        texture.create(kThumbnailAtlasSlots * kThumbnailSize, kThumbnailAtlasSlots * kThumbnailSize);
+        owners.assign(kThumbnailAtlasSlots * kThumbnailAtlasSlots, -1);
+        sizes.assign(owners.size(), sf::Vector2u());
+        lastUsed.assign(owners.size(), 0);
+    }
+    
+    /**
+     * Frees all the slots, e.g, when item indices change
+     */
+    void clear()
+    {
+        owners.assign(owners.size(), -1);
+        lastUsed.assign(owners.size(), 0);
+    }
+    
+    /**
+     * Returns texture rect of slot
+     */
+    sf::IntRect rect(std::size_t slot) const
+    {
+        return sf::IntRect(static_cast<int>((slot % kThumbnailAtlasSlots) * kThumbnailSize),
+                           static_cast<int>((slot / kThumbnailAtlasSlots) * kThumbnailSize),
+                           static_cast<int>(sizes[slot].x),
+                           static_cast<int>(sizes[slot].y));
+    }
+    
+    /**
+     * Finds thumbnail of index and sets its texture rect, returns false if it's not in atlas
+     */
+    bool find(std::size_t index, sf::IntRect* result)
+    {
+        for (std::size_t slot = 0; slot < owners.size(); ++slot)
+        {
+            if (owners[slot] == static_cast<long>(index))
+            {
+                lastUsed[slot] = frame;
+                *result = rect(slot);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    /**
+     * Uploads thumbnail of index in to least recently used slot and returns its texture rect
+     */
+    sf::IntRect add(std::size_t index, const sf::Image& thumbnail)
+    {
+        const std::size_t slot = std::min_element(lastUsed.begin(), lastUsed.end()) - lastUsed.begin();
+        owners[slot] = static_cast<long>(index);
+        sizes[slot] = thumbnail.getSize();
+        lastUsed[slot] = frame;
+        MetricsTimer timer("texture upload", ImageCache::imageBytes(thumbnail));
+        texture.update(thumbnail, (slot % kThumbnailAtlasSlots) * kThumbnailSize, (slot / kThumbnailAtlasSlots) * kThumbnailSize);
+        return rect(slot);
+    }
+};
+
+/**
+ * Tiles of current photo at the resolution needed when it's zoomed in beyond
+ * the downscaled image. Only tiles in visible region are decoded, on worker
+ * thread (JPEG only the area of tile at the scale needed, see decodeJpegRegion()),
+ * and uploaded, least recently used ones are released so memory stays roughly
+ * the same no matter how big the photo is. Until a tile is ready the downscaled
+ * image is shown in its place
+ */
+struct TileLayer
+{
+    /**
+     * Level (each level is half the resolution of previous one), column and row
+     */
+    using Key = std::tuple<unsigned, unsigned, unsigned>;
+    
+    struct Tile
+    {
+        sf::Texture texture;
+        
+        /**
+         * Area of full size image covered by tile
+         */
+        sf::IntRect area;
+        
+        std::size_t lastUsed;
+    };
+    
+    std::map<Key, Tile> tiles;
+    
+    std::size_t frame = 0;
+    
+    /**
+     * Raw data and full size of current photo (nullptr until it's zoomed in)
+     */
+    std::shared_ptr<const char[]> data;
+    std::size_t size = 0;
+    sf::Vector2u sourceSize;
+    
+    /**
+     * Called from worker with bytes of full size image kept for photo that cannot
+     * be decoded by region (zero once it's released), e.g, to count it in the cache
+     */
+    std::function<void(std::size_t)> fullSizeChanged;
+    
+    std::thread worker;
+    
+    std::mutex mutex;
+    
+    std::condition_variable queued;
+    
+    /**
+     * Visible tiles waiting to be decoded, requested ones are waiting or being decoded
+     */
+    std::deque<Key> queue;
+    std::set<Key> requested;
+    
+    /**
+     * Decoded tiles waiting to be uploaded
+     */
+    std::map<Key, sf::Image> decoded;
+    
+    /**
+     * Changes whenever photo changes so that tiles of previous photo are dropped
+     */
+    std::size_t generation = 0;
+    
+    bool stopping = false;
+    
+    ~TileLayer()
+    {
+        stop();
+    }
+    
+    void start()
+    {
+        stopping = false;
+        worker = std::thread(&TileLayer::run, this);
+    }
+    
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+    
+    /**
+     * Starts tiling photo
+     */
+    void open(const std::shared_ptr<const char[]>& data_, std::size_t size_, const sf::Vector2u& sourceSize_)
+    {
+        clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        data = data_;
+        size = size_;
+        sourceSize = sourceSize_;
+    }
+    
+    bool isOpen() const
+    {
+        return data != nullptr;
+    }
+    
+    void clear()
+    {
+        tiles.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            data.reset();
+            queue.clear();
+            requested.clear();
+            decoded.clear();
+            ++generation;
+        }
+        queued.notify_all();
+    }
+    
+    /**
+     * Draws tiles covering visible part of image
+     * \param transform Transform of downscaled image
+     * \param visible Visible area in downscaled image's coordinates
+     * \param scale Size of downscaled image divided by full size
+     * \param zoom Zoom of downscaled image
+     * \return True if visible tiles are still being decoded
+     */
+    bool draw(sf::RenderTarget* target, const sf::Transform& transform, const sf::FloatRect& visible, float scale, float zoom)
+    {
+        ++frame;
+        
+        // lowest resolution that still has a pixel for every screen pixel
+        unsigned level = 0;
+        while (level < 16 && static_cast<float>(2u << level) * scale * zoom <= 1)
+        {
+            ++level;
+        }
+        const unsigned span = kTileSize << level;
+        const float left = std::max(0.0f, visible.left / scale);
+        const float top = std::max(0.0f, visible.top / scale);
+        const float right = std::min(static_cast<float>(sourceSize.x), (visible.left + visible.width) / scale);
+        const float bottom = std::min(static_cast<float>(sourceSize.y), (visible.top + visible.height) / scale);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.clear(); // tiles no longer visible are not decoded
+        sf::RenderStates states(transform);
+        for (unsigned row = static_cast<unsigned>(top) / span; row * span < bottom; ++row)
+        {
+            for (unsigned column = static_cast<unsigned>(left) / span; column * span < right; ++column)
+            {
+                const Key key = std::make_tuple(level, column, row);
+                auto found = tiles.find(key);
+                if (found == tiles.end())
+                {
+                    const auto ready = decoded.find(key);
+                    if (ready == decoded.end())
+                    {
+                        queue.push_back(key);
+                        continue;
+                    }
+                    found = tiles.emplace(key, Tile()).first;
+                    Tile& tile = found->second;
+                    tile.area = area(key);
+                    MetricsTimer timer("texture upload", ImageCache::imageBytes(ready->second));
+                    tile.texture.loadFromImage(ready->second);
+                    decoded.erase(ready);
+                    requested.erase(key);
+                }
+                Tile& tile = found->second;
+                tile.lastUsed = frame;
+                
+                const float x = tile.area.left * scale;
+                const float y = tile.area.top * scale;
+                const float width = tile.area.width * scale;
+                const float height = tile.area.height * scale;
+                const sf::Vector2f textureSize(tile.texture.getSize());
+                const sf::Vertex vertices[] = {
+                    sf::Vertex(sf::Vector2f(x, y), sf::Vector2f(0, 0)),
+                    sf::Vertex(sf::Vector2f(x + width, y), sf::Vector2f(textureSize.x, 0)),
+                    sf::Vertex(sf::Vector2f(x + width, y + height), textureSize),
+                    sf::Vertex(sf::Vector2f(x, y + height), sf::Vector2f(0, textureSize.y))
+                };
+                states.texture = &tile.texture;
+                target->draw(vertices, 4, sf::Quads, states);
+            }
+        }
+        const bool pending = !queue.empty();
+        lock.unlock();
+        queued.notify_one();
+        
+        // release least recently used tiles, the visible ones are always kept
+        while (tiles.size() > kMaximumTiles)
+        {
+            auto oldest = std::min_element(tiles.begin(), tiles.end(), [](const decltype(tiles)::value_type& a, const decltype(tiles)::value_type& b) {
+                return a.second.lastUsed < b.second.lastUsed;
+            });
+            if (oldest->second.lastUsed == frame)
+            {
+                break;
+            }
+            tiles.erase(oldest);
+        }
+        return pending;
+    }
+    
+    /**
+     * Area of full size image covered by tile, mutex must be held
+     */
+    sf::IntRect area(const Key& key) const
+    {
+        const unsigned span = kTileSize << std::get<0>(key);
+        const unsigned column = std::get<1>(key) * span;
+        const unsigned row = std::get<2>(key) * span;
+        return sf::IntRect(column, row, std::min(span, sourceSize.x - column), std::min(span, sourceSize.y - row));
+    }
+    
+    void run()
+    {
+        // full size image of photo that cannot be decoded by region and its generation
+        std::shared_ptr<const sf::Image> image;
+        std::size_t imageGeneration = 0;
+        while (true)
+        {
+            Key key;
+            std::shared_ptr<const char[]> source;
+            std::size_t sourceBytes = 0;
+            std::size_t current = 0;
+            sf::IntRect tileArea;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&]() {
+                    return stopping || (!queue.empty() && data) || (image && imageGeneration != generation);
+                });
+                if (stopping)
+                {
+                    break;
+                }
+                if (image && imageGeneration != generation)
+                {
+                    lock.unlock();
+                    image.reset();
+                    if (fullSizeChanged)
+                    {
+                        fullSizeChanged(0);
+                    }
+                    continue;
+                }
+                key = queue.front();
+                queue.pop_front();
+                if (!requested.insert(key).second)
+                {
+                    continue; // being decoded or waiting for upload
+                }
+                source = data;
+                sourceBytes = size;
+                current = generation;
+                tileArea = area(key);
+            }
+            
+            const unsigned level = std::get<0>(key);
+            const unsigned width = std::max(1u, static_cast<unsigned>(tileArea.width) >> level);
+            const unsigned height = std::max(1u, static_cast<unsigned>(tileArea.height) >> level);
+            sf::Image tile;
+            {
+                MetricsTimer timer("tile decode", static_cast<std::uint64_t>(width) * height * 4);
+                if (!isJpeg(source.get(), sourceBytes) || !decodeJpegRegion(source.get(), sourceBytes, tileArea, std::min(1u << level, 8u), &tile))
+                {
+                    if (!image || imageGeneration != current)
+                    {
+                        MetricsTimer decodeTimer("image decode", sourceBytes);
+                        std::shared_ptr<sf::Image> full = std::make_shared<sf::Image>();
+                        full->loadFromMemory(source.get(), sourceBytes);
+                        image = full;
+                        imageGeneration = current;
+                        if (fullSizeChanged)
+                        {
+                            fullSizeChanged(ImageCache::imageBytes(*image));
+                        }
+                    }
+                    if (static_cast<unsigned>(tileArea.left + tileArea.width) <= image->getSize().x
+                        && static_cast<unsigned>(tileArea.top + tileArea.height) <= image->getSize().y)
+                    {
+                        tile = downscale(*image, tileArea, width, height);
+                    }
+                    else
+                    {
+                        tile.create(width, height, sf::Color::Transparent); // cannot be decoded, downscaled image stays
+                    }
+                }
+                else if (tile.getSize() != sf::Vector2u(width, height))
+                {
+                    // beyond what DCT scaling can do
+                    tile = downscale(tile, sf::IntRect(0, 0, tile.getSize().x, tile.getSize().y), width, height);
+                }
+            }
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            if (current == generation)
+            {
+                decoded[key] = std::move(tile);
+            }
+        }
+        if (image && fullSizeChanged)
+        {
+            fullSizeChanged(0);
+        }
+    }
+};
 
 /**
- * Represents single item with it's attributes
+ * Reads the archive in background so that the window, and the initial photo,
+ * show up before all the photos are read. Everything is handed over to the
+ * viewer on the main thread by takeLoaded()
  */
-struct Item
+struct Loader
 {
+    std::thread thread;
+    
+    std::mutex mutex;
+    
     /**
-     * Raw data (this may take more memory)
+     * What is being done, shown in the title until everything is loaded
      */
-    char* data;
+    std::string status = "Loading...";
     
     /**
-     * Image size (file size in bytes)
+     * Initial photo, as soon as it has been read, at firstInitial. When thumbnails are known
+     * from index of archive it comes with all the other photos (without data until they
+     * are read) so that the thumbnail strip is shown meanwhile
      */
-    std::size_t size;
+    std::vector<Item> first;
+    std::size_t firstInitial = 0;
     
     /**
-     * Filename in archive
+     * All the photos and position of initial photo in them, once done
      */
-    std::string name;
+    std::vector<Item> list;
+    std::size_t initial = 0;
+    bool done = false;
     
     /**
-     * Image object
+     * Library when directory is viewed, once done
      */
-    sf::Image image;
+    std::unique_ptr<Library> library;
     
-    Item(char* data_, std::size_t size_, const std::string& name_)
-        : data(data_), size(size_), name(name_)
+    /**
+     * Index of archive when --index is provided, once done
+     */
+    std::unique_ptr<ArchiveIndex> index;
+    
+    /**
+     * Set instead of done if loading has failed
+     */
+    std::string error;
+    
+    /**
+     * True once everything is handed over to the viewer (main thread only)
+     */
+    bool finished = false;
+    
+    /**
+     * Set to stop loading when the viewer is closed early
+     */
+    std::atomic<bool> cancelled{ false };
+    
+    void setStatus(const std::string& status_)
     {
-        image.loadFromMemory(data_, size_);
+        std::lock_guard<std::mutex> lock(mutex);
+        status = status_;
     }
     
-    Item(const Item& item)
-        : data(item.data), size(item.size), name(item.name)
+    void join()
     {
-        image.loadFromMemory(item.data, item.size);
+        cancelled = true;
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+};
+
+/**
+ * Unlocks archives of library in background, one at a time, as their photos are
+ * viewed. Photos are handed over to the viewer on the main thread by takeUnlocked()
+ */
+struct Unlocker
+{
+    std::thread thread;
+    
+    std::mutex mutex;
+    
+    /**
+     * Archives waiting to be unlocked (main thread only)
+     */
+    std::deque<std::size_t> pending;
+    
+    /**
+     * True while an archive is being unlocked (main thread only)
+     */
+    bool busy = false;
+    
+    /**
+     * Archive being unlocked and its photos (or error) once done
+     */
+    std::size_t archive = 0;
+    std::vector<Item> items;
+    std::string error;
+    bool done = false;
+    
+    void join()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
     }
 };
 
@@ -127,6 +663,11 @@ struct Viewer
      */
     sf::Sprite sprite;
     
+    /**
+     * Full resolution of current photo when it's zoomed in
+     */
+    TileLayer tiles;
+    
     /**
      * Viewer's global rotation tracking variable
      */
@@ -146,6 +687,87 @@ struct Viewer
      * Items in archive being viewed
      */
     std::vector<Item> list;
+    
+    /**
+     * Decoded images of list
+     */
+    ImageCache cache;
+    
+    /**
+     * Decodes images of list in to the cache ahead of navigation
+     */
+    Prefetcher prefetcher;
+    
+    /**
+     * Thumbnails uploaded to the GPU
+     */
+    ThumbnailAtlas thumbnailAtlas;
+    
+    /**
+     * Index of archive (nullptr unless --index is provided)
+     */
+    std::unique_ptr<ArchiveIndex> index;
+    
+    /**
+     * Writes exported photos in background
+     */
+    ExportQueue exporter;
+    
+    /**
+     * Library when directory of archives is viewed, otherwise nullptr
+     */
+    std::unique_ptr<Library> library;
+    
+    Unlocker unlocker;
+    
+    /**
+     * Reads list in background on startup
+     */
+    Loader loader;
+};
+
+/**
+ * Command line arguments, options are in --name=value form
+ * and everything else is positional
+ */
+struct Options
+{
+    std::vector<std::string> positional;
+    
+    std::map<std::string, std::string> values;
+    
+    /**
+     * Returns true if option is provided (with or without value)
+     */
+    bool isSet(const std::string& name) const
+    {
+        return values.find(name) != values.end();
+    }
+    
+    /**
+     * Returns numeric value of option or defaultValue if it's not provided
+     */
+    std::size_t getNumber(const std::string& name, std::size_t defaultValue) const
+    {
+        const auto found = values.find(name);
+        if (found == values.end())
+        {
+            return defaultValue;
+        }
+        try
+        {
+            std::size_t pos = 0;
+            const unsigned long long value = std::stoull(found->second, &pos);
+            if (pos == found->second.size())
+            {
+                return static_cast<std::size_t>(value);
+            }
+        }
+        catch (const std::exception&)
+        {
+        }
+        throw std::invalid_argument("Invalid value for --" + name + ": " + found->second);
+    }
 };
 
 /**
@@ -159,9 +781,9 @@ struct Thumbnail
     std::size_t index;
     
     /**
-     * Thumbnail's sprite to track click
+     * Thumbnail's cell in window to track click
      */
-    sf::Sprite sprite;
+    sf::FloatRect bounds;
 };
 
 /**
@@ -181,91 +803,255 @@ void createDirectory(const std::string& path)
 Viewer viewer;
 
 /**
- * Returns true if subject ends with str
+ * Splits arguments in to options and positional arguments
  */
-bool endsWith(const std::string& subject, const std::string& str)
+Options parseOptions(int argc, const char** argv)
 {
-    if (str.size() > subject.size())
+    Options options;
+    for (int i = 1; i < argc; ++i)
     {
-        return false;
+        const std::string arg = argv[i];
+        if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+        {
+            const std::size_t eq = arg.find('=');
+            options.values[arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2)] =
+                eq == std::string::npos ? "" : arg.substr(eq + 1);
+        }
+        else
+        {
+            options.positional.push_back(arg);
+        }
     }
-    return std::equal(subject.begin() + subject.size() - str.size(), subject.end(), str.begin());
+    return options;
 }
 
 /**
- * Unpacks the encrypted archive and returns temporary filename of unencrypted archive
+ * Returns image of item at index from the cache
  */
-std::string unpack(const std::string& archiveFilename, const std::string& key)
+std::shared_ptr<const sf::Image> getImage(std::size_t index)
 {
+    return viewer.cache.get(index, viewer.list.at(index));
+}
+
+/**
+ * Opens library on loader thread. Archives that are not in the library index are listed
+ * (and library index is updated), then only the archive of initial photo is unlocked
+ */
+void loadLibrary(const std::string& directory, const std::string& key, int initialIndex, bool lockMemory)
+{
+    Loader& loader = viewer.loader;
+    if (key.empty())
+    {
+        throw std::runtime_error("Library needs key of its archives");
+    }
+    std::unique_ptr<Library> library(new Library(directory, key, lockMemory));
+    if (library->archives.empty())
+    {
+        throw std::runtime_error("No archives in [" + directory + "]");
+    }
+    std::cout << "Library of " << library->archives.size() << " archives, "
+              << library->read() << " known from library index" << std::endl;
+    for (std::size_t i = 0; i < library->archives.size(); ++i)
+    {
+        LibraryArchive& archive = library->archives[i];
+        if (archive.listed)
+        {
+            continue;
+        }
+        if (loader.cancelled)
+        {
+            return;
+        }
+        loader.setStatus("Indexing " + std::to_string(i + 1) + " / " + std::to_string(library->archives.size()));
+        try
+        {
+            const std::unique_ptr<OpenArchive> opened = openArchive(archive.filename, key, lockMemory);
+            library->list(i, listImages(*opened->zip));
+            opened->zip->close();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Unable to open [" << archive.filename << "]: " << e.what() << std::endl;
+            archive.state = LibraryArchive::State::Failed;
+        }
+    }
+    try
+    {
+        if (library->write())
+        {
+            std::cout << "Saved library index [" << library->indexFilename() << "]" << std::endl;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
     
-    std::cout << "Unpacking..." << std::endl;
-    
-    std::ifstream ifs(archiveFilename.data());
-    std::string archiveContents((std::istreambuf_iterator<char>(ifs)),
-                                (std::istreambuf_iterator<char>()));
-    
-    if (archiveContents.find_first_of(":") != 32)
+    std::vector<Item> list = library->createItems();
+    if (list.empty())
+    {
+        throw std::runtime_error("No images in library");
+    }
+    const std::size_t initial = std::min(static_cast<std::size_t>(initialIndex), list.size() - 1);
+    LibraryArchive& archive = library->archives[list[initial].archive];
+    loader.setStatus("Unlocking " + fs::path(archive.filename).filename().string());
+    try
+    {
+        Library::apply(&list, library->unlock(list[initial].archive));
+        archive.state = LibraryArchive::State::Unlocked;
+    }
+    catch (const std::exception& e)
     {
-        throw "Invalid encrypted data. Expected <IV>:<B64>";
+        std::cerr << "Unable to unlock [" << archive.filename << "]: " << e.what() << std::endl;
+        archive.state = LibraryArchive::State::Failed;
     }
+    std::cout << list.size() << " images" << std::endl;
     
-    std::string iv(archiveContents.substr(0, 32));
-    std::string contents(archiveContents.substr(33));
-    
-    mine::AES aesManager;
-    aesManager.setKey(key);
-    
-    std::string zip(aesManager.decr(contents, iv, mine::MineCommon::Encoding::Base64, mine::MineCommon::Encoding::Raw));
-    
-    std::string tempFilename("/tmp/insecure-archive-" + mine::AES::generateRandomKey(128) + ".zip");
-    
-    std::cout << "Flushing from memory..." << std::endl;
-    
-    std::ofstream ofs(tempFilename, std::ios::binary);
-    ofs.write(zip.data(), zip.size());
-    ofs.flush();
-    ofs.close();
-    return tempFilename;
+    std::vector<Item> first;
+    if (list[initial].data)
+    {
+        first.emplace_back(list[initial].data, list[initial].size, list[initial].name);
+        first.back().zipIndex = list[initial].zipIndex;
+        first.back().archive = list[initial].archive;
+    }
+    std::lock_guard<std::mutex> lock(loader.mutex);
+    loader.first = std::move(first);
+    loader.list = std::move(list);
+    loader.initial = initial;
+    loader.library = std::move(library);
+    loader.done = true;
 }
 
 /**
- * Loads the items from insecure (unencrypted) archive and returns the list
+ * Reads the archive on loader thread, initial photo (zero-based index) first and the
+ * rest in batches afterwards. Directory is opened as library
+ * \param useIndex Read (and keep) index of archive, see ArchiveIndex
  */
-std::vector<Item> createList(const std::string& insecureArchive, bool doCleanUp)
+void load(const std::vector<std::string> positional, int initialIndex, bool lockMemory, bool useIndex)
 {
-    std::vector<Item> list;
-    std::cout << "Loading..." << std::endl;
-    
-    libzippp::ZipArchive zf(insecureArchive);
-    zf.open(libzippp::ZipArchive::READ_ONLY);
-    
-    const std::vector<libzippp::ZipEntry> entries = zf.getEntries();
-    list.reserve(entries.size());
-    for (auto& entry : entries)
+    Loader& loader = viewer.loader;
+    try
     {
-        if ((endsWith(entry.getName(), ".jpg")
-             || endsWith(entry.getName(), ".png")
-             || endsWith(entry.getName(), ".jpeg")
-             || endsWith(entry.getName(), ".gif")
-             || endsWith(entry.getName(), ".svg"))
-            && (entry.getName().size() > 9
-                && entry.getName().substr(0, 9) != "__MACOSX/")
-            )
+        const std::string& archiveName = positional[0];
+        const std::string key = positional.size() > 1 ? positional[1] : "";
+        if (fs::is_directory(archiveName))
+        {
+            loadLibrary(archiveName, key, initialIndex, lockMemory);
+            return;
+        }
+        
+        // plaintext is only kept in arenas, photos are wiped once the last item is gone and
+        // decrypted zip once loading is done (unless photos stored uncompressed point in to it)
+        const auto arena = std::make_shared<SecureArena>(lockMemory);
+        const std::unique_ptr<OpenArchive> archive = openArchive(archiveName, key, lockMemory, [&](int percent) {
+            if (loader.cancelled)
+            {
+                throw std::runtime_error("Cancelled");
+            }
+            loader.setStatus("Unpacking " + std::to_string(percent) + "%");
+        });
+        const std::shared_ptr<SecureArena>& buffer = archive->buffer;
+        libzippp::ZipArchive* zf = archive->zip.get();
+        
+        std::cout << "Loading..." << std::endl;
+        const std::vector<libzippp::ZipEntry> entries = listImages(*zf);
+        if (entries.empty())
+        {
+            throw std::runtime_error("No images in archive");
+        }
+        const std::size_t initial = static_cast<std::size_t>(std::min(initialIndex, static_cast<int>(entries.size() - 1)));
+        
+        std::vector<Item> first;
+        readItems(*zf, { entries[initial] }, arena, buffer, &first);
+        if (first.empty())
+        {
+            throw std::runtime_error("Unable to read [" + entries[initial].getName() + "]");
+        }
+        Item initialItem(first[0].data, first[0].size, first[0].name);
+        initialItem.zipIndex = first[0].zipIndex;
+        initialItem.crc = first[0].crc;
+        
+        // index is matched by zip index, name, size and checksum, all known before photos are read
+        std::unique_ptr<ArchiveIndex> index;
+        std::size_t firstInitial = 0;
+        if (useIndex)
+        {
+            index.reset(new ArchiveIndex(archiveName, key));
+            if (index->read())
+            {
+                std::vector<Item> all;
+                all.reserve(entries.size());
+                for (const libzippp::ZipEntry& entry : entries)
+                {
+                    all.emplace_back(nullptr, static_cast<std::size_t>(entry.getSize()), entry.getName());
+                    all.back().zipIndex = entry.getIndex();
+                    all.back().crc = static_cast<std::uint32_t>(entry.getCRC());
+                }
+                all[initial].data = first[0].data;
+                std::cout << index->apply(&all) << " thumbnails from index" << std::endl;
+                first = std::move(all);
+                firstInitial = initial;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(loader.mutex);
+            loader.first = std::move(first);
+            loader.firstInitial = firstInitial;
+            loader.status = "Loading 1 / " + std::to_string(entries.size());
+        }
+        
+        // rest in order, initial photo is not read again
+        std::vector<Item> list;
+        std::size_t initialPosition = 0;
+        list.reserve(entries.size());
+        for (std::size_t begin = 0; begin < entries.size(); begin += kLoadBatchSize)
         {
-            list.emplace_back(static_cast<char*>(entry.readAsBinary()),
-                              entry.getSize(),
-                              entry.getName());
+            if (loader.cancelled)
+            {
+                return;
+            }
+            const std::size_t end = std::min(begin + kLoadBatchSize, entries.size());
+            if (initial >= begin && initial < end)
+            {
+                readItems(*zf, std::vector<libzippp::ZipEntry>(entries.begin() + begin, entries.begin() + initial), arena, buffer, &list);
+                initialPosition = list.size();
+                list.push_back(std::move(initialItem));
+                readItems(*zf, std::vector<libzippp::ZipEntry>(entries.begin() + initial + 1, entries.begin() + end), arena, buffer, &list);
+            }
+            else
+            {
+                readItems(*zf, std::vector<libzippp::ZipEntry>(entries.begin() + begin, entries.begin() + end), arena, buffer, &list);
+            }
+            loader.setStatus("Loading " + std::to_string(end) + " / " + std::to_string(entries.size()));
+        }
+        zf->close();
+        list.shrink_to_fit();
+        if (index)
+        {
+            index->apply(&list);
+        }
+        std::cout << list.size() << " images" << std::endl;
+        if (lockMemory && (!arena->isLocked() || (buffer != nullptr && !buffer->isLocked())))
+        {
+            std::cerr << "Unable to lock all the photos in memory (see ulimit -l), they may be swapped to disk" << std::endl;
         }
+        
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.list = std::move(list);
+        loader.initial = initialPosition;
+        loader.index = std::move(index);
+        loader.done = true;
     }
-    zf.close();
-    list.shrink_to_fit();
-    std::cout << list.size() << " images" << std::endl;
-    if (doCleanUp)
+    catch (const char* e)
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.error = e;
+    }
+    catch (const std::exception& e)
     {
-        std::cout << "Clean up..." << std::endl;
-        remove(insecureArchive.c_str());
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.error = loader.cancelled ? "" : e.what();
     }
-    return list;
 }
 
 /**
@@ -332,30 +1118,167 @@ bool moveHorizontallyIfZoomed(float moveFactor)
  */
 std::string getWindowTitle()
 {
-    return std::to_string(viewer.currentIndex + 1) + " / " + std::to_string(viewer.list.size()) + " - Secure Photo - " + viewer.archiveName;
+    if (!viewer.loader.finished)
+    {
+        std::lock_guard<std::mutex> lock(viewer.loader.mutex);
+        return "Secure Photo [" + viewer.loader.status + "] - " + viewer.archiveName;
+    }
+    std::string status = viewer.exporter.status();
+    std::string archiveName = viewer.archiveName;
+    if (viewer.library && !viewer.list.empty())
+    {
+        // library directory and archive of current photo
+        const LibraryArchive& archive = viewer.library->archives.at(viewer.list.at(viewer.currentIndex).archive);
+        archiveName = fs::path(archive.filename).filename().string() + " - " + viewer.archiveName;
+        if (archive.state == LibraryArchive::State::Unlocking)
+        {
+            status = "Unlocking" + (status.empty() ? "" : ", " + status);
+        }
+        else if (archive.state == LibraryArchive::State::Failed)
+        {
+            status = "Unable to open" + (status.empty() ? "" : ", " + status);
+        }
+    }
+    return std::to_string(viewer.currentIndex + 1) + " / " + std::to_string(viewer.list.size()) + " - Secure Photo"
+        + (status.empty() ? "" : " [" + status + "]") + " - " + archiveName;
+}
+
+/**
+ * Returns export of photo at index to kSavePath under random name. Its raw data is written
+ * as it is, item.image.saveToFile(savePath) causes problem because of version of libjpeg
+ * in local dev
+ */
+ExportQueue::Job exportJob(std::size_t index)
+{
+    const Item& item = viewer.list.at(index);
+    const std::size_t dot = item.name.find_last_of('.');
+    const std::string extension = dot == std::string::npos ? "" : item.name.substr(dot);
+    return { item.data, item.size, kSavePath + "secure-photo-" + mine::AES::generateRandomKey(128) + extension };
+}
+
+/**
+ * Queues selected photos (see parseSelection) for export in background, numbers
+ * past the end and photos of archives that are not unlocked (library) are ignored
+ */
+void exportItems(const std::vector<std::pair<std::size_t, std::size_t>>& selection)
+{
+    std::vector<ExportQueue::Job> jobs;
+    std::size_t locked = 0;
+    for (const auto& range : selection)
+    {
+        for (std::size_t i = range.first; i <= std::min(range.second, viewer.list.size()); ++i)
+        {
+            if (!viewer.list.at(i - 1).data)
+            {
+                ++locked;
+                continue;
+            }
+            jobs.push_back(exportJob(i - 1));
+        }
+    }
+    std::cout << "Exporting " << jobs.size() << " photos to [" << kSavePath << "]..." << std::endl;
+    if (locked > 0)
+    {
+        std::cout << "Skipping " << locked << " photos of archives that are not unlocked" << std::endl;
+    }
+    viewer.exporter.add(std::move(jobs));
+}
+
+/**
+ * Starts unlocking next archive waiting unless one is being unlocked already
+ */
+void startNextUnlock()
+{
+    Unlocker& unlocker = viewer.unlocker;
+    if (unlocker.busy || unlocker.pending.empty())
+    {
+        return;
+    }
+    unlocker.join();
+    unlocker.busy = true;
+    unlocker.done = false;
+    unlocker.archive = unlocker.pending.front();
+    unlocker.pending.pop_front();
+    unlocker.thread = std::thread([&unlocker]() {
+        std::vector<Item> items;
+        std::string error;
+        try
+        {
+            items = viewer.library->unlock(unlocker.archive);
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+        std::lock_guard<std::mutex> lock(unlocker.mutex);
+        unlocker.items = std::move(items);
+        unlocker.error = error;
+        unlocker.done = true;
+    });
+}
+
+/**
+ * Queues archive of library for unlocking, unless it's already unlocked (or failed)
+ */
+void requestUnlock(std::size_t archive)
+{
+    LibraryArchive& libraryArchive = viewer.library->archives.at(archive);
+    if (libraryArchive.state != LibraryArchive::State::Locked)
+    {
+        return;
+    }
+    libraryArchive.state = LibraryArchive::State::Unlocking;
+    viewer.unlocker.pending.push_back(archive);
+    startNextUnlock();
 }
 
 /**
- * Navigates to current index
+ * Navigates to current index and prefetches the photos that come next
+ * \param direction 1 when moving forward, -1 when moving backward
  */
-void navigate()
+void navigate(int direction = 1)
 {
-    Item item = viewer.list.at(viewer.currentIndex);
+    const Item& item = viewer.list.at(viewer.currentIndex);
+    if (!item.data)
+    {
+        // archive of photo (library) is not unlocked yet or photo is not read yet, shown once it is
+        if (viewer.library)
+        {
+            requestUnlock(item.archive);
+        }
+        viewer.tiles.clear();
+        viewer.sprite.setTextureRect(sf::IntRect());
+        reset();
+        std::cout << (viewer.library ? "Unlocking [" : "Loading [") << (viewer.currentIndex + 1) << " / "
+                    << viewer.list.size() << "] " << item.name << std::endl;
+        return;
+    }
+    const std::shared_ptr<const sf::Image> image = getImage(viewer.currentIndex);
     
-    viewer.texture.loadFromImage(item.image);
-    viewer.sprite.setTextureRect(sf::IntRect(0, 0, (int) item.image.getSize().x, (int) item.image.getSize().y));
+    {
+        MetricsTimer timer("texture upload", ImageCache::imageBytes(*image));
+        viewer.texture.loadFromImage(*image);
+    }
+    viewer.tiles.clear();
+    viewer.sprite.setTextureRect(sf::IntRect(0, 0, (int) image->getSize().x, (int) image->getSize().y));
     
     viewer.sprite.setScale(1, 1);
     viewer.sprite.setPosition(0, 0);
     std::cout << "Opening [" << (viewer.currentIndex + 1) << " / "
                 << viewer.list.size() << "] " << item.name << " ("
                 << item.size << " bytes)";
-    std::cout << " (" << item.image.getSize().x << " x " << item.image.getSize().y << ")" << std::endl;
+    const sf::Vector2u sourceSize = viewer.cache.sourceSize(viewer.currentIndex);
+    std::cout << " (" << sourceSize.x << " x " << sourceSize.y << ")" << std::endl;
     reset();
+    viewer.prefetcher.schedule(viewer.currentIndex, direction);
 }
 
 void next(sf::Window* window)
 {
+    if (viewer.list.empty())
+    {
+        return;
+    }
     if (++viewer.currentIndex > static_cast<int>(viewer.list.size() - 1))
     {
         viewer.currentIndex = 0;
@@ -366,11 +1289,15 @@ void next(sf::Window* window)
 
 void prev(sf::Window* window)
 {
+    if (viewer.list.empty())
+    {
+        return;
+    }
     if (--viewer.currentIndex < 0)
     {
         viewer.currentIndex = static_cast<int>(viewer.list.size() - 1);
     }
-    navigate();
+    navigate(-1);
     window->setTitle(getWindowTitle());
 }
 
@@ -395,65 +1322,287 @@ void positionAfterRotation()
     }
 }
 
+/**
+ * Hands over what the loader has read to the viewer. Initial photo is shown on its own
+ * (with thumbnails of the other photos when they are in the index) until all the photos
+ * are read, then the list is replaced and prefetching starts
+ * \return True if anything has changed
+ */
+bool takeLoaded()
+{
+    Loader& loader = viewer.loader;
+    std::vector<Item> first;
+    std::size_t firstInitial = 0;
+    std::vector<Item> list;
+    std::unique_ptr<ArchiveIndex> index;
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        first = std::move(loader.first);
+        loader.first.clear();
+        firstInitial = loader.firstInitial;
+        if (loader.done)
+        {
+            list = std::move(loader.list);
+            viewer.library = std::move(loader.library);
+            index = std::move(loader.index);
+        }
+        error = loader.error;
+    }
+    if (!error.empty())
+    {
+        throw std::runtime_error(error);
+    }
+    const bool shown = !first.empty();
+    if (shown)
+    {
+        viewer.list = std::move(first);
+        viewer.currentIndex = static_cast<int>(firstInitial);
+        navigate();
+    }
+    if (list.empty())
+    {
+        return shown;
+    }
+    
+    // current photo stays on screen (or waits until it's read), it is only at a different index in the full list
+    std::size_t position = loader.initial;
+    bool waiting = viewer.list.empty();
+    if (!viewer.list.empty())
+    {
+        const Item& current = viewer.list.at(viewer.currentIndex);
+        waiting = !current.data;
+        const auto found = std::find_if(list.begin(), list.end(), [&](const Item& item) {
+            return item.zipIndex == current.zipIndex && item.archive == current.archive && item.name == current.name;
+        });
+        if (found != list.end())
+        {
+            position = static_cast<std::size_t>(found - list.begin());
+        }
+    }
+    viewer.cache.reindex(viewer.currentIndex, position);
+    viewer.thumbnailAtlas.clear();
+    viewer.list = std::move(list);
+    viewer.currentIndex = static_cast<int>(position);
+    loader.finished = true;
+    loader.join();
+    if (waiting || !viewer.list.at(viewer.currentIndex).data)
+    {
+        navigate(); // photo is read now, or initial photo of library could not be unlocked
+    }
+    
+    if (index)
+    {
+        viewer.index = std::move(index);
+        viewer.cache.thumbnailCreated = [](std::size_t index, const sf::Vector2u& dimensions, const sf::Image& thumbnail) {
+            viewer.index->add(viewer.list.at(index), dimensions, thumbnail);
+        };
+    }
+    
+    if (viewer.prefetcher.count > 0)
+    {
+        viewer.prefetcher.start(&viewer.list, &viewer.cache, kPrefetchThreads);
+    }
+    viewer.prefetcher.schedule(viewer.currentIndex, 1);
+    
+    if (viewer.index)
+    {
+        // complete the index in background, behind the photos being prefetched
+        for (std::size_t i = 0; i < viewer.list.size(); ++i)
+        {
+            if (viewer.list[i].thumbnail.empty())
+            {
+                viewer.prefetcher.requestThumbnail(i);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Releases photos of archives furthest from the current photo while more than
+ * kMaximumUnlockedArchives are unlocked. Their memory is freed once nobody else
+ * (e.g, export or zoomed in photo) holds on to the photos
+ */
+void releaseUnlocked()
+{
+    std::vector<LibraryArchive>& archives = viewer.library->archives;
+    std::size_t unlocked = std::count_if(archives.begin(), archives.end(), [](const LibraryArchive& archive) {
+        return archive.state == LibraryArchive::State::Unlocked;
+    });
+    if (unlocked <= kMaximumUnlockedArchives)
+    {
+        return;
+    }
+    
+    // distance (in photos, both ways round) from current photo to nearest photo of each archive
+    const std::size_t total = viewer.list.size();
+    const std::size_t current = static_cast<std::size_t>(viewer.currentIndex);
+    std::vector<std::size_t> distances(archives.size(), total);
+    for (std::size_t i = 0; i < total; ++i)
+    {
+        const std::size_t distance = i > current ? i - current : current - i;
+        std::size_t& nearest = distances[viewer.list[i].archive];
+        nearest = std::min(nearest, std::min(distance, total - distance));
+    }
+    
+    while (unlocked > kMaximumUnlockedArchives)
+    {
+        std::size_t furthest = archives.size();
+        for (std::size_t i = 0; i < archives.size(); ++i)
+        {
+            if (archives[i].state == LibraryArchive::State::Unlocked && distances[i] > 0
+                && (furthest == archives.size() || distances[i] > distances[furthest]))
+            {
+                furthest = i;
+            }
+        }
+        if (furthest == archives.size())
+        {
+            return;
+        }
+        viewer.prefetcher.changeItems([&]() {
+            for (Item& item : viewer.list)
+            {
+                if (item.archive == furthest)
+                {
+                    item.data.reset();
+                }
+            }
+        });
+        archives[furthest].state = LibraryArchive::State::Locked;
+        --unlocked;
+        std::cout << "Released [" << archives[furthest].filename << "]" << std::endl;
+    }
+}
+
+/**
+ * Hands over photos of archive unlocked in background to the viewer (see Unlocker)
+ * \return True if anything has changed
+ */
+bool takeUnlocked()
+{
+    Unlocker& unlocker = viewer.unlocker;
+    if (!unlocker.busy)
+    {
+        return false;
+    }
+    std::vector<Item> items;
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(unlocker.mutex);
+        if (!unlocker.done)
+        {
+            return false;
+        }
+        items = std::move(unlocker.items);
+        unlocker.items.clear();
+        error = unlocker.error;
+    }
+    unlocker.join();
+    unlocker.busy = false;
+    LibraryArchive& archive = viewer.library->archives.at(unlocker.archive);
+    if (error.empty())
+    {
+        std::size_t found = 0;
+        viewer.prefetcher.changeItems([&]() {
+            found = Library::apply(&viewer.list, std::move(items));
+        });
+        std::cout << "Unlocked " << found << " images of [" << archive.filename << "]" << std::endl;
+        archive.state = LibraryArchive::State::Unlocked;
+        releaseUnlocked();
+    }
+    else
+    {
+        std::cerr << "Unable to unlock [" << archive.filename << "]: " << error << std::endl;
+        archive.state = LibraryArchive::State::Failed;
+    }
+    if (viewer.list.at(viewer.currentIndex).archive == unlocker.archive)
+    {
+        navigate();
+    }
+    startNextUnlock();
+    return true;
+}
+
 int main(int argc, const char** argv)
 {
-    if (argc < 2)
+    const Options options = parseOptions(argc, argv);
+    if (options.positional.empty())
     {
-        std::cout << "Usage: " << argv[0] << " <archive> [<key> = \"\"] [<initial_index> = 0]" << std::endl;
+        std::cout << "Usage: " << argv[0] << " <archive or library directory> [<key> = \"\"] [<initial_index> = 0] [--cache-mb=" << kDefaultCacheMb << "] [--prefetch=" << kDefaultPrefetch << "] [--fps=0] [--index] [--metrics[=<file>]] [--trace=<file>] [--lock-memory] [--export[=<selection>]]" << std::endl;
         return 1;
     }
     
+    metrics().configure(options.isSet("metrics") ? &options.values.at("metrics") : nullptr,
+                        options.isSet("trace") ? &options.values.at("trace") : nullptr);
+    if (metrics().enabled)
+    {
+        mine::AES::setProfiler([](const char* phase, Metrics::Clock::time_point started, Metrics::Clock::time_point ended, std::size_t bytes) {
+            metrics().record(phase, started, ended, bytes);
+        });
+    }
+    
     bool isFullscreen = false;
+    std::size_t frameLimit = 0;
     
-    viewer.archiveName = argv[1];
+    viewer.archiveName = options.positional[0];
     viewer.currentRotation = 0;
     viewer.currentIndex = 0;
     
-    std::string tempFilename;
-    
-    if (argc > 2)
+    try
     {
-        try
-        {
-            tempFilename = unpack(viewer.archiveName, argv[2]);
-        }
-        catch (const char* e)
+        viewer.cache.budget = options.getNumber("cache-mb", kDefaultCacheMb) * 1024 * 1024;
+        viewer.prefetcher.count = options.getNumber("prefetch", kDefaultPrefetch);
+        frameLimit = options.getNumber("fps", 0);
+        
+        // window shows up while archive is read in background, initial photo is read first
+        const int initialIndex = options.positional.size() > 2 ? std::max(atoi(options.positional[2].c_str()) - 1, 0) : 0;
+        if (options.isSet("export"))
         {
-            std::cerr << e << std::endl;
-            return 1;
+            parseSelection(options.values.at("export")); // fails early if invalid
         }
+        viewer.loader.thread = std::thread(load, options.positional, initialIndex, options.isSet("lock-memory"),
+                                           options.positional.size() > 1 && options.isSet("index"));
     }
-    else
+    catch (const char* e)
+    {
+        std::cerr << e << std::endl;
+        return 1;
+    }
+    catch (const std::exception& e)
     {
-        tempFilename = viewer.archiveName; // insecure archive
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
     
-    viewer.list = createList(tempFilename, argc > 2);
-
     std::cout << "Ensuring the directory [" << kSavePath << "] exists ..." << std::endl;
     createDirectory(kSavePath);
-
+    viewer.exporter.start(kExportThreads);
+    
     std::cout << "Loading GUI ..." << std::endl;
     
     const sf::VideoMode winMode = sf::VideoMode::getFullscreenModes().size() == 0
         ? sf::VideoMode::getDesktopMode()
         : sf::VideoMode::getFullscreenModes().at(0);
-
+    
     sf::Image winIcon;
     const std::string rawIcon = mine::Base64::decode(kWindowIcon);
     winIcon.loadFromMemory((void*) rawIcon.data(), rawIcon.size());
     sf::RenderWindow window(winMode, "Secure Photo [Loading...]");
     window.setIcon(256, 256, winIcon.getPixelsPtr());
-    
-    if (argc > 3)
-    {
-        viewer.currentIndex = std::max(std::min(atoi(argv[3]) - 1, static_cast<int>(viewer.list.size() - 1)), 0);
-    }
+    window.setFramerateLimit(static_cast<unsigned>(frameLimit));
     
     viewer.sprite.setTexture(viewer.texture);
+    viewer.thumbnailAtlas.create();
+    viewer.tiles.fullSizeChanged = [](std::size_t bytes) {
+        viewer.cache.setExternalBytes(bytes);
+    };
+    viewer.tiles.start();
     
-    navigate();
-    window.setTitle(getWindowTitle());
+    // photos are decoded to fit the screen, tiles of full size are loaded when zoomed in
+    viewer.cache.displaySize = sf::Vector2u(std::min(winMode.width, sf::Texture::getMaximumSize()),
+                                            std::min(winMode.height, sf::Texture::getMaximumSize()));
     
     // Buttons
     sf::Texture downloadTexture;
@@ -466,10 +1615,21 @@ int main(int argc, const char** argv)
     
     std::map<std::size_t, Thumbnail> thumbnails;
     
+    // frame is only drawn when it's dirty, otherwise we sleep until next event. While
+    // thumbnails are still being created in background the strip is redrawn periodically
+    // and while archive is being loaded, loader is checked periodically
+    bool dirty = true;
+    bool thumbnailsPending = false;
+    bool tilesPending = false;
+    bool exporting = false;
+    std::string title;
+    int result = 0;
+    
     while (window.isOpen())
     {
         sf::Event event;
-        while (window.pollEvent(event))
+        bool hasEvent = dirty || thumbnailsPending || tilesPending || exporting || viewer.unlocker.busy || !viewer.loader.finished ? window.pollEvent(event) : window.waitEvent(event);
+        for (; hasEvent; hasEvent = window.pollEvent(event))
         {
             bool newPhoto = false;
             sf::Vector2i pos = sf::Mouse::getPosition(window);
@@ -480,9 +1640,14 @@ int main(int argc, const char** argv)
                     break;
                 case sf::Event::MouseMoved:
                 {
-                    buttonsSprite.setColor(buttonsSprite.getGlobalBounds().contains(event.mouseMove.x, event.mouseMove.y)
+                    const sf::Color color = buttonsSprite.getGlobalBounds().contains(event.mouseMove.x, event.mouseMove.y)
                                             ? kDownloadButtonHoverColor
-                                            : kDownloadButtonDefaultColor);
+                                            : kDownloadButtonDefaultColor;
+                    if (color != buttonsSprite.getColor())
+                    {
+                        buttonsSprite.setColor(color);
+                        dirty = true;
+                    }
                     break;
                 }
                 case sf::Event::MouseButtonPressed:
@@ -490,19 +1655,14 @@ int main(int argc, const char** argv)
                     switch (event.mouseButton.button)
                     {
                         case sf::Mouse::Button::Left:
-                            if (buttonsSprite.getGlobalBounds().contains(pos.x, pos.y))
+                            if (buttonsSprite.getGlobalBounds().contains(pos.x, pos.y) && !viewer.list.empty())
                             {
-                                const Item item = viewer.list.at(viewer.currentIndex);
-                                const std::string extension = item.name.substr(item.name.find_last_of("."));
-                                const std::string filename = kSavePath + "secure-photo-" + mine::AES::generateRandomKey(128) + extension;
-                                std::cout << "Saving... [" << filename << "]" << std::endl;
-                                
-                                // item.image.saveToFile(savePath) causes problem because of version of libjpeg in local dev
-                                // so we manually save the raw data
-                                std::ofstream ofs(filename, std::ios::binary);
-                                ofs.write(item.data, item.size);
-                                ofs.flush();
-                                ofs.close();
+                                if (!viewer.list.at(viewer.currentIndex).data)
+                                {
+                                    break; // not unlocked yet
+                                }
+                                std::cout << "Saving... [" << viewer.list.at(viewer.currentIndex).name << "]" << std::endl;
+                                viewer.exporter.add({ exportJob(viewer.currentIndex) });
                             }
                             else
                             {
@@ -510,7 +1670,7 @@ int main(int argc, const char** argv)
                                 for (auto& thumbnailPair : thumbnails)
                                 {
                                     const Thumbnail* const thumbnail = &(thumbnailPair.second);
-                                    if (thumbnail->sprite.getGlobalBounds().contains(pos.x, pos.y))
+                                    if (thumbnail->bounds.contains(pos.x, pos.y))
                                     {
                                         newIndex = thumbnail->index;
                                         break;
@@ -550,6 +1710,16 @@ int main(int argc, const char** argv)
                                             ? sf::Style::Default
                                             : sf::Style::Default | sf::Style::Fullscreen);
                             isFullscreen = !isFullscreen;
+                            window.setFramerateLimit(static_cast<unsigned>(frameLimit));
+                            break;
+                        case sf::Keyboard::I:
+                            viewer.cache.report(std::cout);
+                            break;
+                        case sf::Keyboard::E:
+                            if (viewer.loader.finished)
+                            {
+                                exportItems(parseSelection("all"));
+                            }
                             break;
                         case sf::Keyboard::Right:
                             if (!moveHorizontallyIfZoomed(-kMoveFactor))
@@ -596,14 +1766,84 @@ int main(int argc, const char** argv)
                 default:
                     break;
             }
+            if (event.type != sf::Event::MouseMoved)
+            {
+                // navigation, zoom, rotation, resize, focus etc.
+                dirty = true;
+            }
+        }
+        
+        const bool loading = !viewer.loader.finished;
+        if (loading && window.isOpen())
+        {
+            try
+            {
+                dirty = takeLoaded() || dirty;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << std::endl;
+                result = 1;
+                window.close();
+                continue;
+            }
+            if (viewer.loader.finished && options.isSet("export"))
+            {
+                exportItems(parseSelection(options.values.at("export")));
+            }
+        }
+        dirty = takeUnlocked() || dirty;
+        
+        // progress of loading or exporting, one more time after it's done
+        exporting = viewer.exporter.isBusy();
+        if (window.isOpen() && getWindowTitle() != title)
+        {
+            title = getWindowTitle();
+            window.setTitle(title);
+        }
+        
+        if (!dirty)
+        {
+            if (!(thumbnailsPending || tilesPending || loading || exporting || viewer.unlocker.busy) || !window.isOpen())
+            {
+                continue;
+            }
+            sf::sleep(kPendingThumbnailsInterval);
+            if (!(thumbnailsPending || tilesPending))
+            {
+                continue;
+            }
         }
+        dirty = false;
+        thumbnailsPending = false;
+        tilesPending = false;
         
+        MetricsTimer frameTimer("frame");
         window.clear(sf::Color::Black);
         window.draw(viewer.sprite);
         
+        const sf::Vector2u sourceSize = viewer.cache.sourceSize(viewer.currentIndex);
+        if (viewer.sprite.getScale().x > 1 && sourceSize.x > viewer.texture.getSize().x)
+        {
+            if (!viewer.tiles.isOpen())
+            {
+                const Item& item = viewer.list.at(viewer.currentIndex);
+                viewer.tiles.open(item.data, item.size, sourceSize);
+            }
+            const sf::View& view = window.getView();
+            const sf::FloatRect visible = viewer.sprite.getInverseTransform().transformRect(
+                        sf::FloatRect(view.getCenter() - view.getSize() / 2.0f, view.getSize()));
+            tilesPending = viewer.tiles.draw(&window,
+                                             viewer.sprite.getTransform(),
+                                             visible,
+                                             static_cast<float>(viewer.texture.getSize().x) / sourceSize.x,
+                                             viewer.sprite.getScale().x);
+        }
+        
         // thumbnails
         
-        const float kThumbnailScale = 7;
+        sf::VertexArray thumbnailVertices(sf::Quads);
+        ++viewer.thumbnailAtlas.frame;
         
         const std::size_t firstThumbnailIndex = std::max(viewer.currentIndex - (kMaximumThumbnails / 2), 0);
         const std::size_t totalThumbnails = std::min(viewer.list.size(), static_cast<std::size_t>(kMaximumThumbnails));
@@ -611,29 +1851,83 @@ int main(int argc, const char** argv)
              i < std::min(totalThumbnails + firstThumbnailIndex, viewer.list.size());
              ++i, ++idx)
         {
-            sf::Texture thumbnailTexture;
-            sf::Sprite thumbnailSprite(thumbnailTexture);
-            Item item = viewer.list.at(i);
-            thumbnailTexture.loadFromImage(item.image);
-            thumbnailSprite.setPosition(((window.getSize().x / 2) - ((totalThumbnails / 2) * kThumbnailSize)) + (idx * kThumbnailSize),
-                                        window.getSize().y - kThumbnailSize - 10);
-            thumbnailSprite.setTextureRect(sf::IntRect(0, 0, kThumbnailSize * kThumbnailScale, kThumbnailSize * kThumbnailScale));
-            thumbnailSprite.setScale(1 / kThumbnailScale, 1 / kThumbnailScale);
-            if (i == viewer.currentIndex)
+            sf::IntRect textureRect;
+            if (!viewer.list.at(i).data && viewer.list.at(i).thumbnail.empty())
             {
-                thumbnailSprite.setColor(sf::Color(255, 255, 255, 100));
+                // archive not unlocked yet (library)
+                thumbnails.erase(idx);
+                continue;
             }
-            else
+            if (!viewer.thumbnailAtlas.find(i, &textureRect))
+            {
+                // thumbnails not created yet are left to prefetch workers, unless there are
+                // none or the thumbnail is in the index (small enough to decode here)
+                std::shared_ptr<const sf::Image> thumbnail = viewer.cache.peekThumbnail(i);
+                if (!thumbnail && (!viewer.prefetcher.isRunning() || !viewer.list.at(i).thumbnail.empty()))
+                {
+                    thumbnail = viewer.cache.loadThumbnail(i, viewer.list.at(i));
+                }
+                if (!thumbnail)
+                {
+                    viewer.prefetcher.requestThumbnail(i);
+                    thumbnailsPending = true;
+                    thumbnails.erase(idx);
+                    continue;
+                }
+                textureRect = viewer.thumbnailAtlas.add(i, *thumbnail);
+            }
+            const sf::FloatRect bounds(((window.getSize().x / 2) - ((totalThumbnails / 2) * kThumbnailSize)) + (idx * kThumbnailSize),
+                                       window.getSize().y - kThumbnailSize - 10,
+                                       kThumbnailSize,
+                                       kThumbnailSize);
+            // centre thumbnail in its cell
+            const float left = bounds.left + (kThumbnailSize - textureRect.width) / 2.0f;
+            const float top = bounds.top + (kThumbnailSize - textureRect.height) / 2.0f;
+            const sf::Color color = static_cast<int>(i) == viewer.currentIndex ? sf::Color(255, 255, 255, 100) : sf::Color(255, 255, 255, 200);
+            const sf::Vector2f corners[] = {
+                sf::Vector2f(0, 0),
+                sf::Vector2f(textureRect.width, 0),
+                sf::Vector2f(textureRect.width, textureRect.height),
+                sf::Vector2f(0, textureRect.height)
+            };
+            for (const sf::Vector2f& corner : corners)
             {
-                thumbnailSprite.setColor(sf::Color(255, 255, 255, 200));
+                thumbnailVertices.append(sf::Vertex(sf::Vector2f(left + corner.x, top + corner.y),
+                                                    color,
+                                                    sf::Vector2f(textureRect.left + corner.x, textureRect.top + corner.y)));
             }
-            thumbnails[idx] = { i, thumbnailSprite };
-            window.draw(thumbnailSprite);
+            thumbnails[idx] = { i, bounds };
         }
+        window.draw(thumbnailVertices, &viewer.thumbnailAtlas.texture);
         
         window.draw(buttonsSprite);
         window.display();
     }
-    return 0;
+    viewer.loader.join();
+    viewer.unlocker.join();
+    viewer.tiles.stop();
+    viewer.prefetcher.stop();
+    if (viewer.exporter.isBusy())
+    {
+        std::cout << "Waiting for " << viewer.exporter.status() << "..." << std::endl;
+    }
+    viewer.exporter.stop();
+    viewer.cache.report(std::cout);
+    if (viewer.index)
+    {
+        try
+        {
+            if (viewer.index->write(viewer.list))
+            {
+                std::cout << "Saved index [" << viewer.index->filename << "]" << std::endl;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+    metrics().write();
+    return result;
 }
 
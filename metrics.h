@@ -0,0 +1,240 @@
+/**
+ * Runtime instrumentation of secure photo viewer, off unless enabled with
+ * --metrics[=<file>] or SPV_METRICS=<file> (1 for standard output)
+ *
+ * Records wall time and bytes of each phase (file read, Base-64 decode, AES
+ * decryption, zip open, entry inflate, image decode, texture upload, frame),
+ * writes JSON summary at exit and, with --trace=<file> or SPV_TRACE=<file>,
+ * every recorded span as Chrome trace events (chrome://tracing or Perfetto)
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+/**
+ * Maximum number of spans kept for trace file, later ones are only summarized
+ */
+static const std::size_t kMaximumTraceEvents = 1000000;
+
+struct Metrics
+{
+    using Clock = std::chrono::steady_clock;
+    
+    /**
+     * Totals of a phase
+     */
+    struct Phase
+    {
+        std::size_t count = 0;
+        double totalMs = 0;
+        double maxMs = 0;
+        std::uint64_t bytes = 0;
+    };
+    
+    /**
+     * Single recorded span, for trace file
+     */
+    struct Event
+    {
+        std::string phase;
+        std::size_t thread;
+        Clock::time_point started;
+        Clock::time_point ended;
+        std::uint64_t bytes;
+    };
+    
+    /**
+     * True when phases are recorded, set before any other thread starts
+     */
+    bool enabled = false;
+    
+    /**
+     * Where summary is written ("-" for standard output) and trace file (empty for none)
+     */
+    std::string summaryFilename = "-";
+    std::string traceFilename;
+    
+    Clock::time_point started = Clock::now();
+    
+    std::map<std::string, Phase> phases;
+    
+    std::vector<Event> events;
+    
+    /**
+     * Small number for each thread seen, trace viewers show them as rows
+     */
+    std::map<std::thread::id, std::size_t> threads;
+    
+    std::mutex mutex;
+    
+    /**
+     * Enables metrics from command line option values or environment
+     * \param summary Value of --metrics (nullptr if not provided)
+     * \param trace Value of --trace (nullptr if not provided)
+     */
+    void configure(const std::string* summary, const std::string* trace)
+    {
+        const char* summaryEnv = std::getenv("SPV_METRICS");
+        const char* traceEnv = std::getenv("SPV_TRACE");
+        if (summary == nullptr && summaryEnv != nullptr && *summaryEnv != '\0')
+        {
+            summaryFilename = std::string(summaryEnv) == "1" ? "-" : summaryEnv;
+            enabled = true;
+        }
+        else if (summary != nullptr)
+        {
+            summaryFilename = summary->empty() ? "-" : *summary;
+            enabled = true;
+        }
+        if (trace != nullptr && !trace->empty())
+        {
+            traceFilename = *trace;
+        }
+        else if (traceEnv != nullptr && *traceEnv != '\0')
+        {
+            traceFilename = traceEnv;
+        }
+        enabled = enabled || !traceFilename.empty();
+        started = Clock::now();
+    }
+    
+    /**
+     * Records span of phase, called from any thread
+     */
+    void record(const std::string& phase, Clock::time_point spanStarted, Clock::time_point spanEnded, std::uint64_t bytes = 0)
+    {
+        if (!enabled)
+        {
+            return;
+        }
+        const double ms = std::chrono::duration<double, std::milli>(spanEnded - spanStarted).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        Phase& total = phases[phase];
+        ++total.count;
+        total.totalMs += ms;
+        total.maxMs = std::max(total.maxMs, ms);
+        total.bytes += bytes;
+        if (!traceFilename.empty() && events.size() < kMaximumTraceEvents)
+        {
+            const auto thread = threads.emplace(std::this_thread::get_id(), threads.size()).first->second;
+            events.push_back({ phase, thread, spanStarted, spanEnded, bytes });
+        }
+    }
+    
+    /**
+     * Writes JSON summary of phases (and trace file if enabled)
+     */
+    void write()
+    {
+        if (!enabled)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (summaryFilename == "-")
+        {
+            writeSummary(std::cout);
+        }
+        else
+        {
+            std::ofstream ofs(summaryFilename, std::ios::trunc);
+            writeSummary(ofs);
+            std::cout << "Saved metrics [" << summaryFilename << "]" << std::endl;
+        }
+        if (!traceFilename.empty())
+        {
+            std::ofstream ofs(traceFilename, std::ios::trunc);
+            writeTrace(ofs);
+            std::cout << "Saved trace [" << traceFilename << "]" << std::endl;
+        }
+    }
+    
+    void writeSummary(std::ostream& os) const
+    {
+        os << "{\"wall_ms\":" << std::chrono::duration<double, std::milli>(Clock::now() - started).count()
+           << ",\"phases\":{";
+        bool firstPhase = true;
+        for (const auto& phase : phases)
+        {
+            const double seconds = phase.second.totalMs / 1000;
+            os << (firstPhase ? "" : ",") << "\"" << phase.first << "\":{"
+               << "\"count\":" << phase.second.count
+               << ",\"total_ms\":" << phase.second.totalMs
+               << ",\"mean_ms\":" << (phase.second.totalMs / phase.second.count)
+               << ",\"max_ms\":" << phase.second.maxMs
+               << ",\"bytes\":" << phase.second.bytes
+               << ",\"mb_per_s\":" << (seconds > 0 ? phase.second.bytes / seconds / 1024 / 1024 : 0)
+               << "}";
+            firstPhase = false;
+        }
+        os << "}}" << std::endl;
+    }
+    
+    void writeTrace(std::ostream& os) const
+    {
+        const auto microseconds = [&](Clock::time_point time) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(time - started).count();
+        };
+        os << "{\"traceEvents\":[";
+        for (std::size_t i = 0; i < events.size(); ++i)
+        {
+            const Event& event = events[i];
+            os << (i == 0 ? "" : ",\n")
+               << "{\"name\":\"" << event.phase << "\",\"cat\":\"spv\",\"ph\":\"X\""
+               << ",\"ts\":" << microseconds(event.started)
+               << ",\"dur\":" << std::max<long long>(microseconds(event.ended) - microseconds(event.started), 0)
+               << ",\"pid\":1,\"tid\":" << event.thread
+               << ",\"args\":{\"bytes\":" << event.bytes << "}}";
+        }
+        os << "]}" << std::endl;
+    }
+};
+
+/**
+ * Metrics of the process
+ */
+inline Metrics& metrics()
+{
+    static Metrics instance;
+    return instance;
+}
+
+/**
+ * Records span from construction to destruction (bytes can be set in between)
+ */
+struct MetricsTimer
+{
+    const char* phase;
+    std::uint64_t bytes;
+    Metrics::Clock::time_point started;
+    
+    explicit MetricsTimer(const char* phase_, std::uint64_t bytes_ = 0)
+        : phase(phase_), bytes(bytes_), started(metrics().enabled ? Metrics::Clock::now() : Metrics::Clock::time_point())
+    {
+    }
+    
+    ~MetricsTimer()
+    {
+        if (metrics().enabled)
+        {
+            metrics().record(phase, started, Metrics::Clock::now(), bytes);
+        }
+    }
+};
+
+#endif // METRICS_H
@@ -0,0 +1,91 @@
+/**
+ * Packs zip of photos (or converts version 1 archive) in to version 2 archive
+ * that secure photo viewer reads chunk by chunk, see archive.h
+ *
+ *    ./secure-photo-packer <input> <key> <output> [--chunk-kb=<N>]
+ *
+ * Input is either a plain zip file or version 1 archive (<IV>:<Base-64 of Encrypted Zip File>)
+ * encrypted with the same key
+ *
+ * Options:
+ *      --chunk-kb=<N>: Number of KB of zip in each chunk (default: 1024)
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#include <string>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "external/mine.h"
+#include "archive.h"
+
+/**
+ * Opens input as stream of zip, version 1 archive is decrypted in to memory first
+ */
+std::unique_ptr<std::istream> openZip(const std::string& filename, const std::string& key)
+{
+    std::unique_ptr<std::ifstream> ifs(new std::ifstream(filename, std::ios::binary));
+    char header[33];
+    if (!ifs->read(header, sizeof(header)))
+    {
+        throw std::runtime_error("Unable to read [" + filename + "]");
+    }
+    if (header[32] != ':')
+    {
+        ifs->seekg(0);
+        return std::unique_ptr<std::istream>(std::move(ifs));
+    }
+    
+    std::cout << "Converting version 1 archive..." << std::endl;
+    mine::AES aesManager;
+    aesManager.setKey(key);
+    aesManager.setThreadCount(0); // all hardware threads
+    std::unique_ptr<std::stringstream> zip(new std::stringstream());
+    aesManager.decr(*ifs, mine::Base16::fromString(std::string(header, 32)), [&](const mine::byte* data, std::size_t len) {
+        zip->write(reinterpret_cast<const char*>(data), len);
+    }, mine::MineCommon::Encoding::Base64);
+    return std::unique_ptr<std::istream>(std::move(zip));
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <input> <key> <output> [--chunk-kb=<N>]" << std::endl;
+        return 1;
+    }
+    
+    try
+    {
+        std::uint32_t chunkSize = kDefaultArchiveChunkSize;
+        for (int i = 4; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg.compare(0, 11, "--chunk-kb=") == 0)
+            {
+                chunkSize = static_cast<std::uint32_t>(std::stoul(arg.substr(11)) * 1024);
+            }
+            else
+            {
+                throw std::invalid_argument("Unknown option: " + arg);
+            }
+        }
+        
+        const std::unique_ptr<std::istream> zip = openZip(argv[1], argv[2]);
+        const std::string output = argv[3];
+        std::ofstream ofs(output, std::ios::binary | std::ios::trunc);
+        packChunkedArchive(*zip, ofs, argv[2], chunkSize);
+        std::cout << "Packed [" << output << "]" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,378 @@
+/**
+ * Headless tests for secure photo viewer, these do not need a display
+ *
+ *    make test
+ *
+ * Each test prints test <name> ok (or FAILED with the reason) and the
+ * run fails if any of them fails
+ *
+ * Tests:
+ *      - block_cipher: FIPS-197 known answers and CBC round trip with every backend
+ *                      (see mine::AES::Backend) supported by this CPU
+ *      - base64: Decoding across SIMD block boundaries, with whitespace, invalid
+ *                characters and padding, also in two pieces as streams are decoded
+ *      - stream_decryptor: mine::AES::StreamDecryptor fed in arbitrary pieces gives
+ *                          the same plain as one-shot decryption
+ *      - entry_reader: Seeks forward, skips and seeks backward inside deflated
+ *                      and stored zip entries with ZipEntryReader
+ *      - archive_chunks: Packs random bytes as version 2 archive and reads every
+ *                        chunk back, full chunks are not padded and may end in any byte
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <filesystem>
+#include <algorithm>
+
+#include <zip.h>
+
+#include "external/mine.h"
+#include "external/libzippp.h"
+#include "archive.h"
+
+/**
+ * FIPS-197 example vectors (appendix B and C), Base-16
+ */
+struct KnownAnswer
+{
+    const char* key;
+    const char* plain;
+    const char* cipher;
+};
+
+static const KnownAnswer kKnownAnswers[] = {
+    { "2B7E151628AED2A6ABF7158809CF4F3C", "3243F6A8885A308D313198A2E0370734", "3925841D02DC09FBDC118597196A0B32" },
+    { "000102030405060708090A0B0C0D0E0F", "00112233445566778899AABBCCDDEEFF", "69C4E0D86A7B0430D8CDB78070B4C55A" },
+    { "000102030405060708090A0B0C0D0E0F1011121314151617", "00112233445566778899AABBCCDDEEFF", "DDA97CA4864CDFE06EAF70A0EC0D7191" },
+    { "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F", "00112233445566778899AABBCCDDEEFF", "8EA2B7CA516745BFEAFC49904B496089" },
+};
+
+/**
+ * Size of zip entries read by entry reader test
+ */
+static const std::size_t kEntrySize = 1024 * 1024 + 123;
+
+/**
+ * Chunk size and number of chunks packed by archive chunks test, random chunks
+ * end in a byte that looks like padding (2 to 16) about one time in sixteen
+ */
+static const std::uint32_t kTestChunkSize = 64 * 1024;
+static const std::size_t kTestChunks = 256;
+
+/**
+ * Throws with reason unless condition holds
+ */
+void check(bool condition, const std::string& reason)
+{
+    if (!condition)
+    {
+        throw std::runtime_error(reason);
+    }
+}
+
+/**
+ * Random bytes of length len
+ */
+std::string randomBytes(std::mt19937* random, std::size_t len)
+{
+    std::string bytes(len, '\0');
+    for (char& c : bytes)
+    {
+        c = static_cast<char>((*random)());
+    }
+    return bytes;
+}
+
+/**
+ * True if decoding encoded base64 throws std::invalid_argument
+ */
+bool failsToDecode(const std::string& encoded)
+{
+    try
+    {
+        mine::Base64::decode(encoded);
+    }
+    catch (const std::invalid_argument&)
+    {
+        return true;
+    }
+    return false;
+}
+
+std::string backendName(mine::AES::Backend backend)
+{
+    switch (backend)
+    {
+        case mine::AES::Backend::Reference:
+            return "reference";
+        case mine::AES::Backend::TTable:
+            return "t-table";
+        case mine::AES::Backend::AesNi:
+            return "aes-ni";
+    }
+    return "unknown";
+}
+
+void testBlockCipher()
+{
+    std::mt19937 random(197);
+    const mine::ByteArray zeroIV(16, 0);
+    const std::string data = randomBytes(&random, 4099);
+    mine::ByteArray firstCipher;
+    for (mine::AES::Backend backend : { mine::AES::Backend::Reference, mine::AES::Backend::TTable, mine::AES::Backend::AesNi })
+    {
+        if (!mine::AES::isSupported(backend))
+        {
+            std::cout << "skipping " << backendName(backend) << " backend, not supported by this CPU" << std::endl;
+            continue;
+        }
+        const std::string name = backendName(backend);
+        mine::AES aesManager;
+        aesManager.setBackend(backend);
+        for (const KnownAnswer& answer : kKnownAnswers)
+        {
+            // single block in CBC mode with zero IV is the block cipher itself
+            const mine::AES::Key key = mine::Base16::fromString(answer.key);
+            const mine::ByteArray plain = mine::Base16::fromString(answer.plain);
+            const std::string bits = std::to_string(key.size() * 8);
+            mine::ByteArray cipher(plain.size());
+            aesManager.encryptInto(plain.data(), plain.size(), cipher.data(), &key, zeroIV);
+            check(cipher == mine::Base16::fromString(answer.cipher), name + ": wrong cipher with " + bits + " bit key");
+            mine::ByteArray decrypted(cipher.size());
+            decrypted.resize(aesManager.decryptInto(cipher.data(), cipher.size(), decrypted.data(), &key, zeroIV));
+            check(decrypted == plain, name + ": wrong plain with " + bits + " bit key");
+        }
+        
+        // many blocks, some backends decipher several at a time
+        const mine::AES::Key key = mine::Base16::fromString(kKnownAnswers[3].key);
+        const mine::ByteArray iv = mine::Base16::fromString(kKnownAnswers[3].plain);
+        mine::ByteArray cipher(mine::AES::cipherSize(data.size()));
+        aesManager.encryptInto(reinterpret_cast<const mine::byte*>(data.data()), data.size(), cipher.data(), &key, iv);
+        if (firstCipher.empty())
+        {
+            firstCipher = cipher;
+        }
+        check(cipher == firstCipher, name + ": cipher differs from other backends");
+        std::string decrypted(cipher.size(), '\0');
+        decrypted.resize(aesManager.decryptInto(cipher.data(), cipher.size(), reinterpret_cast<mine::byte*>(&decrypted[0]), &key, iv));
+        check(decrypted == data, name + ": wrong plain of " + std::to_string(data.size()) + " bytes");
+    }
+}
+
+void testBase64()
+{
+    std::mt19937 random(64);
+    const std::pair<std::string, std::string> padded[] = { { "QQ==", "A" }, { "QUI=", "AB" }, { "QUJD", "ABC" }, { "QUJDRA==", "ABCD" }, { " QUJD\r\nRA==\n", "ABCD" } };
+    for (const auto& example : padded)
+    {
+        check(mine::Base64::decode(example.first) == example.second, "wrong decoding of " + example.first);
+    }
+    check(failsToDecode("QQ=") && failsToDecode("QUJDRA") && failsToDecode("Q==="), "incomplete input decoded");
+    
+    // encoded lengths cross the blocks decoded at a time
+    for (std::size_t len = 1; len < 300; ++len)
+    {
+        const std::string raw = randomBytes(&random, len);
+        const std::string encoded = mine::Base64::encode(raw);
+        const std::string what = " of " + std::to_string(len) + " bytes";
+        check(mine::Base64::decode(encoded) == raw, "wrong decoding" + what);
+        
+        // line breaks (MIME) and whitespace anywhere
+        std::string spaced;
+        for (std::size_t i = 0; i < encoded.size(); ++i)
+        {
+            if (i > 0 && i % 76 == 0)
+            {
+                spaced += "\r\n";
+            }
+            if (random() % 8 == 0)
+            {
+                spaced += " \t\n"[random() % 3];
+            }
+            spaced += encoded[i];
+        }
+        check(mine::Base64::decode(spaced) == raw, "wrong decoding with whitespace" + what);
+        
+        // in two pieces cut anywhere, incomplete quad of first piece is decoded with the second
+        const std::size_t cut = random() % (spaced.size() + 1);
+        std::string decoded(mine::Base64::maxDecodedLength(spaced.size()), '\0');
+        std::size_t consumed = 0;
+        std::size_t written = mine::Base64::decode(spaced.data(), cut, reinterpret_cast<mine::byte*>(&decoded[0]), &consumed);
+        check(consumed <= cut, "consumed more than input" + what);
+        written += mine::Base64::decode(spaced.data() + consumed, spaced.size() - consumed, reinterpret_cast<mine::byte*>(&decoded[written]));
+        decoded.resize(written);
+        check(decoded == raw, "wrong decoding in pieces cut at " + std::to_string(cut) + what);
+        
+        std::string invalid = encoded;
+        invalid[random() % invalid.size()] = "*-_.\x80\xff"[random() % 6];
+        check(failsToDecode(invalid), "invalid character decoded" + what);
+    }
+}
+
+void testStreamDecryptor()
+{
+    std::mt19937 random(2);
+    mine::AES aesManager;
+    const std::string key = mine::AES::generateRandomKey(256);
+    aesManager.setKey(key);
+    // lengths are not multiple of block size, full last block is not padded
+    for (std::size_t len : { 1, 15, 17, 1001, 65537, 100003 })
+    {
+        const std::string plain = randomBytes(&random, len);
+        std::string iv;
+        const std::string encoded = aesManager.encr(plain, iv, mine::MineCommon::Encoding::Raw, mine::MineCommon::Encoding::Base64);
+        const std::string expected = aesManager.decr(encoded, iv, mine::MineCommon::Encoding::Base64, mine::MineCommon::Encoding::Raw);
+        const std::string what = " of " + std::to_string(len) + " bytes";
+        check(expected == plain, "wrong one-shot decryption" + what);
+        
+        for (mine::MineCommon::Encoding encoding : { mine::MineCommon::Encoding::Base64, mine::MineCommon::Encoding::Raw })
+        {
+            const std::string cipher = encoding == mine::MineCommon::Encoding::Raw ? mine::Base64::decode(encoded) : encoded;
+            for (std::size_t threadCount : { 1, 3 })
+            {
+                for (std::size_t maxPiece : { 7, 5000 })
+                {
+                    std::string result;
+                    mine::AES::StreamDecryptor decryptor(mine::Base16::fromString(key), mine::Base16::fromString(iv), [&](const mine::byte* data, std::size_t n) {
+                        result.append(reinterpret_cast<const char*>(data), n);
+                    }, encoding, threadCount);
+                    for (std::size_t offset = 0; offset < cipher.size();)
+                    {
+                        const std::size_t piece = std::min<std::size_t>(cipher.size() - offset, 1 + random() % maxPiece);
+                        decryptor.update(cipher.data() + offset, piece);
+                        offset += piece;
+                    }
+                    check(decryptor.finalize() == expected.size() && result == expected,
+                          "wrong stream decryption" + what + " in pieces of up to " + std::to_string(maxPiece) + " bytes");
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Content of zip entries, compressible but different at every offset
+ */
+std::string entryContent()
+{
+    std::string content(kEntrySize, '\0');
+    for (std::size_t i = 0; i < content.size(); ++i)
+    {
+        content[i] = static_cast<char>((i * 7) ^ (i >> 9));
+    }
+    return content;
+}
+
+/**
+ * Reads len bytes with reader and checks them against content at reader's position
+ */
+void checkRead(libzippp::ZipEntryReader* reader, const std::string& content, std::size_t len)
+{
+    const libzippp_uint64 position = reader->tell();
+    std::vector<char> buffer(len);
+    check(reader->read(buffer.data(), len) == static_cast<libzippp_int64>(len), "read failed at " + std::to_string(position));
+    check(std::memcmp(buffer.data(), content.data() + position, len) == 0, "wrong bytes at " + std::to_string(position));
+}
+
+void testEntryReader()
+{
+    const std::string content = entryContent();
+    const std::string zipFilename = (std::filesystem::temp_directory_path() / "secure-photo-test.zip").string();
+    {
+        libzippp::ZipArchive zf(zipFilename);
+        check(zf.open(libzippp::ZipArchive::NEW), "unable to create zip");
+        check(zf.addData("deflated.bin", content.data(), content.size()), "unable to add deflated entry");
+        check(zf.addData("stored.bin", content.data(), content.size()), "unable to add stored entry");
+        check(zf.getEntry("stored.bin").setCompressionEnabled(false), "unable to store entry");
+        check(zf.close() == LIBZIPPP_OK, "unable to write zip");
+    }
+    
+    libzippp::ZipArchive zf(zipFilename);
+    check(zf.open(libzippp::ZipArchive::READ_ONLY), "unable to open zip");
+    for (const std::string& name : { std::string("deflated.bin"), std::string("stored.bin") })
+    {
+        const libzippp::ZipEntry entry = zf.getEntry(name);
+        check(entry.getCompressionMethod() == (name == "stored.bin" ? ZIP_CM_STORE : ZIP_CM_DEFLATE), name + " has unexpected compression");
+        
+        libzippp::ZipEntryReader reader(entry);
+        check(reader.isOpen(), "unable to open " + name);
+        checkRead(&reader, content, 100);
+        check(reader.seek(300000), name + ": seek forward failed");
+        checkRead(&reader, content, 4096);
+        check(reader.skip(70000) == 70000, name + ": skip failed");
+        checkRead(&reader, content, 65536 + 17);
+        check(reader.seek(10), name + ": seek backward failed");
+        checkRead(&reader, content, 1000);
+        check(reader.seek(kEntrySize - 5), name + ": seek near the end failed");
+        checkRead(&reader, content, 5);
+        check(reader.isEnd() && !reader.seek(kEntrySize + 1), name + ": seek past the end");
+    }
+    zf.close();
+    std::filesystem::remove(zipFilename);
+}
+
+void testArchiveChunks()
+{
+    std::mt19937 random(2024);
+    std::string content(kTestChunkSize * kTestChunks + 1000, '\0');
+    for (char& c : content)
+    {
+        c = static_cast<char>(random());
+    }
+    const std::string key = "163E6AC9C7C6B4DDBBC9EDD7E4B1FA7C0BBDF0AC8B3F33A2E6A3EA8E3CE0D3B8";
+    const std::string archiveFilename = (std::filesystem::temp_directory_path() / "secure-photo-test.spa").string();
+    {
+        std::istringstream zip(content);
+        std::ofstream output(archiveFilename, std::ios::binary);
+        packChunkedArchive(zip, output, key, kTestChunkSize);
+    }
+    
+    ChunkedArchive archive(archiveFilename, key);
+    check(archive.size() == content.size(), "wrong size " + std::to_string(archive.size()));
+    std::string chunk(kTestChunkSize, '\0');
+    for (std::uint64_t offset = 0; offset < content.size(); offset += kTestChunkSize)
+    {
+        const std::size_t len = static_cast<std::size_t>(std::min<std::uint64_t>(kTestChunkSize, content.size() - offset));
+        check(archive.read(offset, &chunk[0], len), "unable to read chunk at " + std::to_string(offset));
+        check(std::memcmp(chunk.data(), content.data() + offset, len) == 0, "wrong bytes in chunk at " + std::to_string(offset));
+    }
+    std::filesystem::remove(archiveFilename);
+}
+
+/**
+ * Runs test and reports the result
+ * \return True if it passed
+ */
+bool run(const std::string& name, void (*test)())
+{
+    try
+    {
+        test();
+        std::cout << "test " << name << " ok" << std::endl;
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "test " << name << " FAILED: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+int main()
+{
+    bool ok = run("block_cipher", testBlockCipher);
+    ok = run("base64", testBase64) && ok;
+    ok = run("stream_decryptor", testStreamDecryptor) && ok;
+    ok = run("entry_reader", testEntryReader) && ok;
+    ok = run("archive_chunks", testArchiveChunks) && ok;
+    return ok ? 0 : 1;
+}
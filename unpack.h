@@ -0,0 +1,325 @@
+/**
+ * Reading of secure archive (<IV>:<Base-64 of Encrypted Zip File>) in to
+ * photos, shared by viewer and benchmarks
+ *
+ * Author: abumq (Majid Q.)
+ * https://github.com/abumq/SecurePhotoViewer
+ */
+
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zip.h>
+
+#include "external/mine.h"
+#include "external/libzippp.h"
+#include "gallery.h"
+#include "arena.h"
+#include "archive.h"
+#include "metrics.h"
+
+/**
+ * Number of archive bytes decrypted at a time when unpacking. Each chunk is
+ * split between all the hardware threads so it needs to be reasonably large
+ */
+static const std::size_t kUnpackChunkSize = 4 * 1024 * 1024;
+
+/**
+ * Returns true if subject ends with str
+ */
+inline bool endsWith(const std::string& subject, const std::string& str)
+{
+    if (str.size() > subject.size())
+    {
+        return false;
+    }
+    return std::equal(subject.begin() + subject.size() - str.size(), subject.end(), str.begin());
+}
+
+/**
+ * Read-only memory mapping of whole file, read once without copying it in to the
+ * heap. MADV_SEQUENTIAL makes the kernel read ahead aggressively and lets it
+ * reclaim pages behind the reader sooner, they stay in the page cache until
+ * then (or until unmapped). Not open (data is nullptr) if file can not be mapped,
+ * e.g, it is empty or not a regular file
+ */
+struct MappedFile
+{
+    const char* data = nullptr;
+    std::size_t size = 0;
+    
+    explicit MappedFile(const std::string& filename)
+    {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        {
+            void* mapped = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                madvise(mapped, static_cast<std::size_t>(info.st_size), MADV_SEQUENTIAL);
+                data = static_cast<const char*>(mapped);
+                size = static_cast<std::size_t>(info.st_size);
+            }
+        }
+        ::close(fd); // mapping stays valid
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    ~MappedFile()
+    {
+        if (data != nullptr)
+        {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+    
+    bool isOpen() const
+    {
+        return data != nullptr;
+    }
+};
+
+/**
+ * Unpacks the encrypted archive in to secure arena and returns the unencrypted zip
+ * archive contents. The contents never touch the disk, they are opened straight from
+ * memory. Archive is memory-mapped and decrypted in place when possible, otherwise
+ * it is streamed
+ * \param size Set to size of contents
+ * \param progress Called with percentage unpacked after each chunk
+ */
+inline const char* unpack(const std::string& archiveFilename, const std::string& key, SecureArena* arena, std::size_t* size,
+                          const std::function<void(int)>& progress = nullptr)
+{
+    
+    std::cout << "Unpacking..." << std::endl;
+    
+    static const std::size_t kHeaderSize = 33;
+    const MappedFile mapped(archiveFilename);
+    std::ifstream ifs;
+    std::size_t archiveSize = mapped.size;
+    char header[kHeaderSize];
+    if (mapped.isOpen())
+    {
+        if (mapped.size < kHeaderSize)
+        {
+            throw "Invalid encrypted data. Expected <IV>:<B64>";
+        }
+        std::copy(mapped.data, mapped.data + kHeaderSize, header);
+    }
+    else
+    {
+        std::error_code error;
+        archiveSize = static_cast<std::size_t>(std::filesystem::file_size(archiveFilename, error));
+        archiveSize = error ? 0 : archiveSize; // unknown for pipes, progress is not reported then
+        ifs.open(archiveFilename, std::ios::binary);
+        if (!ifs.read(header, kHeaderSize))
+        {
+            throw "Invalid encrypted data. Expected <IV>:<B64>";
+        }
+    }
+    if (header[32] != ':')
+    {
+        throw "Invalid encrypted data. Expected <IV>:<B64>";
+    }
+    
+    const std::string iv(header, 32);
+    
+    mine::AES aesManager;
+    aesManager.setKey(key);
+    aesManager.setThreadCount(0); // all hardware threads
+    
+    // decrypted in chunks, straight in to the result. Expected size (size of Base-64
+    // decoded payload) is never exceeded, buffer only grows when it is not known
+    const std::size_t expectedSize = std::max<std::size_t>(archiveSize > kHeaderSize ? (archiveSize - kHeaderSize) / 4 * 3 : 0, 1);
+    std::size_t capacity = archiveSize > 0 ? expectedSize : kUnpackChunkSize;
+    char* zip = arena->allocate(capacity);
+    *size = 0;
+    const auto sink = [&](const mine::byte* data, std::size_t len) {
+        if (*size + len > capacity)
+        {
+            capacity = std::max(capacity * 2, *size + len);
+            char* grown = arena->allocate(capacity); // previous buffer is wiped with arena
+            std::memcpy(grown, zip, *size);
+            zip = grown;
+        }
+        std::memcpy(zip + *size, data, len);
+        *size += len;
+        if (progress && archiveSize > 0)
+        {
+            progress(static_cast<int>(std::min<std::size_t>(*size * 100 / expectedSize, 100)));
+        }
+    };
+    if (mapped.isOpen())
+    {
+        aesManager.decr(mapped.data + kHeaderSize, mapped.size - kHeaderSize, mine::Base16::fromString(iv),
+                        sink, mine::MineCommon::Encoding::Base64, kUnpackChunkSize);
+    }
+    else
+    {
+        aesManager.decr(ifs, mine::Base16::fromString(iv), sink, mine::MineCommon::Encoding::Base64, kUnpackChunkSize);
+    }
+    return zip;
+}
+
+/**
+ * Returns the photos in open archive
+ */
+inline std::vector<libzippp::ZipEntry> listImages(libzippp::ZipArchive& zf)
+{
+    std::vector<libzippp::ZipEntry> images;
+    for (auto& entry : zf.getEntries())
+    {
+        if ((endsWith(entry.getName(), ".jpg")
+             || endsWith(entry.getName(), ".png")
+             || endsWith(entry.getName(), ".jpeg")
+             || endsWith(entry.getName(), ".gif")
+             || endsWith(entry.getName(), ".svg"))
+            && (entry.getName().size() > 9
+                && entry.getName().substr(0, 9) != "__MACOSX/")
+            )
+        {
+            images.push_back(entry);
+        }
+    }
+    return images;
+}
+
+/**
+ * Reads entries of open archive in to items, appended to list. Entries are read in parallel
+ * in to secure arena, photos stored without compression in buffer (in-memory archive)
+ * are not copied. Items keep arena (or buffer) alive
+ * \param buffer Arena holding in-memory archive, nullptr if it is not read from memory
+ */
+inline void readItems(libzippp::ZipArchive& zf, const std::vector<libzippp::ZipEntry>& entries,
+                      const std::shared_ptr<SecureArena>& arena, const std::shared_ptr<SecureArena>& buffer,
+                      std::vector<Item>* list)
+{
+    if (entries.empty())
+    {
+        return;
+    }
+    // entries that are copied (not photos stored uncompressed in buffer) are read in to one slab
+    std::size_t total = 0;
+    for (const libzippp::ZipEntry& entry : entries)
+    {
+        if (buffer == nullptr || entry.getCompressionMethod() != ZIP_CM_STORE || entry.getEncryptionMethod() != ZIP_EM_NONE)
+        {
+            total += (std::max<std::size_t>(static_cast<std::size_t>(entry.getSize()), 1) + kSecureArenaAlignment - 1) / kSecureArenaAlignment * kSecureArenaAlignment;
+        }
+    }
+    if (total > 0)
+    {
+        arena->reserve(total);
+    }
+    SecureArena* target = arena.get();
+    const auto allocator = [target](const libzippp::ZipEntry&, libzippp_uint64 size) -> char* {
+        try
+        {
+            return target->allocate(static_cast<std::size_t>(size));
+        }
+        catch (const std::bad_alloc&)
+        {
+            return nullptr;
+        }
+    };
+    for (libzippp::ZipEntryData& content : zf.readEntries(entries, 0, allocator))
+    {
+        if (content.readStarted > 0 && content.readEnded > 0)
+        {
+            metrics().record("entry inflate",
+                             Metrics::Clock::time_point(std::chrono::duration_cast<Metrics::Clock::duration>(std::chrono::nanoseconds(content.readStarted))),
+                             Metrics::Clock::time_point(std::chrono::duration_cast<Metrics::Clock::duration>(std::chrono::nanoseconds(content.readEnded))),
+                             content.size);
+        }
+        if (!content.isOk())
+        {
+            std::cerr << "Unable to read [" << content.entry.getName() << "]" << std::endl;
+            continue;
+        }
+        const std::shared_ptr<SecureArena>& owner = content.isView() && buffer != nullptr ? buffer : arena;
+        list->emplace_back(std::shared_ptr<const char[]>(owner, content.data), content.size, content.entry.getName());
+        list->back().zipIndex = content.entry.getIndex();
+        list->back().crc = static_cast<std::uint32_t>(content.entry.getCRC());
+    }
+}
+
+/**
+ * Archive opened for reading entries. Decrypted zip (of version 1 archive) or
+ * chunked archive are kept until it is destroyed, zip is closed first
+ */
+struct OpenArchive
+{
+    /**
+     * Arena holding decrypted zip of version 1 archive, otherwise nullptr
+     */
+    std::shared_ptr<SecureArena> buffer;
+    
+    std::unique_ptr<ChunkedArchive> chunked;
+    
+    std::unique_ptr<libzippp::ZipArchive> zip;
+};
+
+/**
+ * Opens archive: version 2 archive is read chunk by chunk, version 1 archive is unpacked
+ * in to memory and without key it is opened as (insecure) zip file
+ * \param lockMemory Lock decrypted zip in memory, see SecureArena
+ * \param progress Called with percentage unpacked (version 1 archive only)
+ */
+inline std::unique_ptr<OpenArchive> openArchive(const std::string& filename, const std::string& key, bool lockMemory,
+                                                const std::function<void(int)>& progress = nullptr)
+{
+    std::unique_ptr<OpenArchive> archive(new OpenArchive());
+    if (!key.empty() && isChunkedArchive(filename))
+    {
+        // only chunks holding the central directory and the photos are decrypted
+        archive->chunked.reset(new ChunkedArchive(filename, key, lockMemory));
+        ChunkedArchive* source = archive->chunked.get();
+        archive->zip.reset(new libzippp::ZipArchive([source](libzippp_uint64 offset, void* data, libzippp_uint64 len) {
+            return source->read(offset, data, len);
+        }, source->size()));
+    }
+    else if (!key.empty())
+    {
+        // decrypted zip is opened from memory
+        archive->buffer = std::make_shared<SecureArena>(lockMemory);
+        std::size_t zipSize = 0;
+        const char* zip = unpack(filename, key, archive->buffer.get(), &zipSize, progress);
+        archive->zip.reset(new libzippp::ZipArchive(zip, zipSize));
+    }
+    else
+    {
+        archive->zip.reset(new libzippp::ZipArchive(filename)); // insecure archive
+    }
+    
+    MetricsTimer timer("zip open");
+    if (!archive->zip->open(libzippp::ZipArchive::READ_ONLY))
+    {
+        throw std::runtime_error("Unable to open archive [" + filename + "]");
+    }
+    return archive;
+}
+
+#endif // UNPACK_H